@@ -0,0 +1,35 @@
+#ifndef __CPU_UTIL_H
+#define __CPU_UTIL_H
+
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Thread placement for the hypervisor and its VMs. A negative CPU leaves the
+ * thread to the scheduler.
+ *
+ * If vm_cpus is empty but hypervisor_cpu is set, VMs are spread over the CPUs
+ * of the hypervisor's NUMA node so the hand-off from the select() loop stays
+ * on one socket. Without NUMA topology in sysfs, they are spread over all
+ * online CPUs. Either way the hypervisor CPU is left to the select() loop.
+ */
+struct PlacementPolicy {
+    int hypervisor_cpu;   // CPU running the select() loop
+    vector<int> vm_cpus;  // CPUs VM ingress threads are assigned to round-robin
+
+    PlacementPolicy() : hypervisor_cpu(-1) {}
+};
+
+class CpuUtil {
+    public:
+        static int PinThread(thread &t, int cpu);
+        static int PinCurrentThread(int cpu);
+        static int GetNumaNode(int cpu);
+        static vector<int> GetNodeCpus(int node);
+        static vector<int> GetOnlineCpus();
+        static int SetPreferredNode(int node);
+};
+
+#endif
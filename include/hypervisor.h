@@ -4,28 +4,84 @@
 #include <string>
 #include <mutex>
 #include <thread>
+#include <vector>
+#include <unordered_set>
 #include <vm.h>
+#include <shm_channel.h>
+#include <cpu_util.h>
+#include <poll_stats.h>
 #include <atomic>
+#include <chrono>
 
 #define BUF_SIZE 2000
+#define BUSY_POLL_SELECT_EVERY 64 // Busy-poll hits between non-blocking select() calls
 
 using namespace std;
+
+/**
+ * Counters of ARP requests handled by the hypervisor instead of the VMs.
+ */
+struct ArpSuppressionStats {
+    uint64_t replied; // requests answered by the hypervisor
+    uint64_t dropped; // broadcast requests not delivered to a VM they were not for
+};
+
 class Hypervisor {
     private:
         unordered_map<int, VirtualMachine *> vm_map; // Map from tap fd to VM
+        unordered_map<int, ShmChannel *> channel_map; // Map from tap fd to out-of-process VM
+        unordered_map<int, pair<pid_t, int>> pid_map; // Map from pidfd to (pid, tap fd) of out-of-process VM
+        unordered_set<int> blocked_egress; // Tap fds with egress frames waiting for POLLOUT
         mutex vm_map_mutex;
 
         atomic<int> max_fd;
         atomic<int> next_vm_id;
         thread select_thread;
+        PlacementPolicy placement; // Guarded by vm_map_mutex
+        atomic<long> busy_poll_us; // Busy-poll budget, 0 disables busy polling
+        PollCounters poll_counters;
+        IngressPolicy ingress_policy; // Guarded by vm_map_mutex
+
+        // ARP suppression, guarded by vm_map_mutex
+        bool arp_suppression;
+        unordered_map<int, pair<string, string>> tap_addr_map; // Map from tap fd to VM (MAC, IP)
+        unordered_map<string, string> arp_table;       // Map from VM IP to MAC
+        unordered_map<string, string> proxy_arp_table; // Map from remote IP to MAC
+        atomic<uint64_t> arp_replied, arp_dropped;
+        atomic<bool> tap_filter; // Attach a BPF filter to new TAPs
+        string bridge;           // Bridge to add new TAPs to, guarded by vm_map_mutex
 
-		void BuildFdSet(fd_set *fds);
-		void HandleRead(fd_set *fds);
+		void BuildFdSet(fd_set *rfds, fd_set *wfds);
+		int HandleRead(fd_set *fds);
+		void HandleWrite(fd_set *fds);
+        int FlushEgress(int tap_fd, VirtualMachine *vm);
+        bool BusyPoll(chrono::microseconds budget);
+        void SetPeerPolling(bool polling);
+        int ReadToChannel(int tap_fd, ShmChannel *channel);
+        int WriteFromChannel(int tap_fd, ShmChannel *channel);
+        void RemoveRemoteVM(int pid_fd);
+        bool AnswerArp(const uint8_t *frame, size_t len, uint8_t *reply);
+        bool FilterIngressArp(int tap_fd, const uint8_t *frame, size_t len);
+        void AddVmAddr(int tap_fd, const string &mac, const string &ip);
+        int JoinBridge(const string &tap_name);
         void Init();
+        int PickVmCpu(int vm_id);
     public:
         Hypervisor() { Init(); }
         VirtualMachine *createVM(const string& mac, const string& ip);
+        pid_t createRemoteVM(const string& mac, const string& ip,
+                             const string& vm_prog, const vector<string>& args);
         void removeVM(int vm_id); // TODO: Implement
+        void SetPlacementPolicy(const PlacementPolicy &policy);
+        void SetBusyPoll(chrono::microseconds budget);
+        void SetIngressPolicy(const IngressPolicy &policy);
+        PollStats GetPollStats() const { return poll_counters.Snapshot(); }
+        void SetArpSuppression(bool enabled);
+        void SetTapFilter(bool enabled);
+        void SetBridge(const string &name);
+        void AddProxyArp(const string &ip, const string &mac);
+        void RemoveProxyArp(const string &ip);
+        ArpSuppressionStats GetArpSuppressionStats() const;
 };
 
 #endif
@@ -0,0 +1,35 @@
+#ifndef __POLL_STATS_H
+#define __POLL_STATS_H
+
+#include <atomic>
+#include <cstdint>
+
+using namespace std;
+
+/**
+ * Snapshot of where a polling thread spent its time waiting for work.
+ */
+struct PollStats {
+    uint64_t spin_ns;       // time spent busy-polling
+    uint64_t sleep_ns;      // time spent blocked in select() or a condition variable
+    uint64_t spin_hits;     // busy-poll rounds that found work
+    uint64_t spin_misses;   // busy-poll rounds that ran out of budget
+    uint64_t sleeps;        // number of blocking waits
+};
+
+class PollCounters {
+    private:
+        atomic<uint64_t> spin_ns;
+        atomic<uint64_t> sleep_ns;
+        atomic<uint64_t> spin_hits;
+        atomic<uint64_t> spin_misses;
+        atomic<uint64_t> sleeps;
+    public:
+        PollCounters() : spin_ns(0), sleep_ns(0), spin_hits(0),
+                         spin_misses(0), sleeps(0) {}
+        void AddSpin(uint64_t ns, bool hit);
+        void AddSleep(uint64_t ns);
+        PollStats Snapshot() const;
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef __SHM_CHANNEL_H
+#define __SHM_CHANNEL_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+#define SHM_RING_SLOTS 256
+#define SHM_SLOT_SIZE  2048
+
+struct shm_slot {
+    uint32_t len;
+    uint8_t  data[SHM_SLOT_SIZE];
+};
+
+/**
+ * Single-producer single-consumer frame ring in shared memory. Callers with
+ * several producer threads must serialise AcquireTx()/CommitTx()/Send().
+ *
+ * The producer fills slots[head % SHM_RING_SLOTS] and then advances head.
+ * The consumer drains slots[tail % SHM_RING_SLOTS] and then advances tail.
+ * While the consumer is polling it sets no_notify so that the producer can
+ * skip the eventfd kick, like VRING_USED_F_NO_NOTIFY in virtio. The consumer
+ * also kicks the producer when it frees a slot of a full ring, so that a
+ * producer waiting for room can sleep.
+ *
+ * The memory comes zero-filled from the memfd, which is a valid initial state
+ * for the lock-free atomics below.
+ *
+ * The peer can write anything to the ring at any time, so each side keeps its
+ * own index privately and only trusts the peer's index after checking it.
+ */
+struct shm_ring {
+    atomic<uint32_t> head;
+    atomic<uint32_t> tail;
+    atomic<uint32_t> no_notify;
+    struct shm_slot  slots[SHM_RING_SLOTS];
+};
+
+/**
+ * A pair of shm_rings shared between the hypervisor and an out-of-process VM,
+ * one per direction, each with an eventfd used to kick the consumer.
+ */
+class ShmChannel {
+    private:
+        int mem_fd;
+        int tx_kick_fd; // Written after producing on tx_ring
+        int rx_kick_fd; // Signalled when the peer produced on rx_ring
+        struct shm_ring *tx_ring;
+        struct shm_ring *rx_ring;
+        uint32_t tx_head;  // Our copy of tx_ring->head
+        uint32_t rx_tail;  // Our copy of rx_ring->tail
+        atomic<uint64_t> tx_drops;
+        atomic<uint64_t> rx_errors; // Malformed frames or ring state from the peer
+        atomic<bool> broken; // The peer corrupted rx_ring, nothing more is received
+
+        void Kick();
+
+        ShmChannel(int mem_fd, int tx_kick_fd, int rx_kick_fd,
+                   struct shm_ring *tx_ring, struct shm_ring *rx_ring)
+            : mem_fd(mem_fd), tx_kick_fd(tx_kick_fd), rx_kick_fd(rx_kick_fd),
+              tx_ring(tx_ring), rx_ring(rx_ring), tx_head(0), rx_tail(0),
+              tx_drops(0), rx_errors(0), broken(false) {}
+    public:
+        static ShmChannel *Create(int *vm_mem_fd, int *vm_tx_kick_fd, int *vm_rx_kick_fd);
+        static ShmChannel *Attach(int mem_fd, int tx_kick_fd, int rx_kick_fd);
+        ~ShmChannel();
+
+        uint8_t *AcquireTx();
+        bool IsTxFull() { return AcquireTx() == NULL; }
+        void CommitTx(uint32_t len);
+        bool Send(const uint8_t *buf, size_t len);
+        const uint8_t *PeekRx(uint32_t *len);
+        void ReleaseRx();
+
+        int GetRxFd() const { return rx_kick_fd; }
+        void AckRx();
+        void RearmRx();
+        bool WaitRx(int timeout_ms);
+        void SetPolling(bool polling);
+        bool IsBroken() const { return broken; }
+        uint64_t GetTxDrops() const { return tx_drops; }
+        uint64_t GetRxErrors() const { return rx_errors; }
+};
+
+#endif
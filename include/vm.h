@@ -3,36 +3,125 @@
 
 #include <string>
 #include <unordered_map>
-#include <set>
+#include <map>
 #include <utility>
 #include <mutex>
-#include <queue>
+#include <deque>
+#include <vector>
 #include <thread>
 #include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <unistd.h>
+#include <poll_stats.h>
+#include <shm_channel.h>
 
 using namespace std;
 
+#define EGRESS_QUEUE_LEN 256 // Frames queued before SendToNetwork() blocks
+#define INGRESS_POOL_FRAMES 64 // Frame buffers a pinned VM keeps on its NUMA node
+
+/**
+ * Snapshot of the egress queue counters of a VM.
+ */
+struct EgressStats {
+    uint64_t enqueued;  // frames queued by SendToNetwork()
+    uint64_t sent;      // frames written to the TAP
+    uint64_t dropped;   // frames dropped because the queue stayed full
+    uint64_t errors;    // frames lost to write() errors or partial writes
+    uint64_t intercepted; // frames consumed by the hypervisor instead of the TAP
+    uint64_t doorbells; // times the hypervisor was kicked
+    uint64_t flushes;   // batches flushed by the hypervisor
+};
+
+/**
+ * What to drop when the ingress queue of a VM is full.
+ *
+ * INGRESS_DROP_PRIORITY only applies to frames that reach SendToVm() while the
+ * queue is full. That needs IngressPolicy::backpressure off, or frames the
+ * hypervisor delivers itself, e.g. ARP replies under ARP suppression. With
+ * back-pressure the TAP is not read while the queue is full, so ARP waits in
+ * the kernel's TAP queue behind everything else.
+ */
+enum IngressDropPolicy {
+    INGRESS_DROP_TAIL,     // Drop the incoming frame
+    INGRESS_DROP_PRIORITY, // Make room for ARP by dropping the newest non-ARP frames
+};
+
+/**
+ * Bounds of the ingress queue of a VM. A frame is accepted while the queue
+ * holds fewer than max_frames frames and fewer than max_bytes bytes, so
+ * max_bytes may be exceeded by one frame.
+ */
+struct IngressPolicy {
+    size_t max_frames;
+    size_t max_bytes;
+    IngressDropPolicy drop_policy;
+    bool backpressure; // Stop reading the TAP of the VM while its queue, or shared ring, is full
+
+    IngressPolicy() : max_frames(1024), max_bytes(1 << 20),
+                      drop_policy(INGRESS_DROP_TAIL), backpressure(true) {}
+};
+
+/**
+ * Snapshot of the ingress queue counters of a VM.
+ */
+struct IngressStats {
+    uint64_t enqueued;  // frames accepted by SendToVm()
+    uint64_t dropped;   // incoming frames dropped because the queue was full
+    uint64_t evicted;   // queued frames dropped to make room for priority frames
+    uint64_t throttled; // times the queue filled up
+    uint64_t resumed;   // times the hypervisor was told to read the TAP again
+};
+
 class VirtualMachine {
     private:
         string mac;
         string ip;
         int tap_fd;
+        int cpu; // CPU the ingress thread is pinned to, -1 if not pinned
+        ShmChannel *channel; // Link to the hypervisor if the VM runs out of process
         uint16_t icmp_id, icmp_seq;
 
         unordered_map<string, string> arp_table;
-        set<pair<uint16_t, uint16_t>> icmp_replies;
-        queue<uint8_t> ingress_queue;
+        map<pair<uint16_t, uint16_t>, bool> icmp_waiters; // Outstanding pings, true once answered
+        deque<vector<uint8_t>> ingress_queue;
+        deque<vector<uint8_t>> ingress_pool; // Spare frame buffers faulted in by the ingress thread
+        size_t ingress_bytes;           // Bytes in ingress_queue
+        IngressPolicy ingress_policy;   // Guarded by ingress_queue_mutex
+        atomic<size_t> ingress_pending; // Size of ingress_queue, readable without the lock
+        atomic<bool> ingress_full;      // ingress_queue is at its bounds
+        atomic<bool> ingress_backpressure; // Copy of ingress_policy.backpressure
+        atomic<uint64_t> ingress_enqueued, ingress_dropped, ingress_evicted, ingress_throttled;
+        atomic<uint64_t> ingress_resumed;
+        vector<uint8_t> ingress_frame;  // Frame being parsed by the ingress thread
+        size_t ingress_offset;          // Parse position in ingress_frame
+        atomic<long> busy_poll_us;      // Busy-poll budget, 0 disables busy polling
+        PollCounters poll_counters;         // Waits of the ingress thread
+        PollCounters channel_poll_counters; // Waits of the channel thread, out of process only
+
+        // Frames waiting for the hypervisor to write them to the TAP
+        deque<vector<uint8_t>> egress_queue;
+        mutex egress_queue_mutex;
+        condition_variable egress_cv;
+        int doorbell_fd;                // eventfd kicked when egress_queue becomes non-empty, -1 out of process
+        atomic<bool> egress_polled;     // The hypervisor polls egress_queue, no need to kick
+        atomic<size_t> egress_pending;  // Size of egress_queue, readable without the lock
+        atomic<uint64_t> egress_enqueued, egress_sent, egress_dropped, egress_errors;
+        atomic<uint64_t> egress_doorbells, egress_flushes, egress_intercepted;
 
         mutex ingress_queue_mutex;
         mutex arp_table_mutex;
         mutex icmp_reply_mutex;
 
         condition_variable ingress_cv;
+        condition_variable ingress_space_cv;
         condition_variable arp_cv;
         condition_variable icmp_cv;
 
         thread ingress_proc_thread;
+        thread channel_thread;
 
         void Init();
         void Deinit();
@@ -40,15 +129,41 @@ class VirtualMachine {
         void SendIcmp(const string &dst_ip, const string &dst_mac,
                       uint8_t type, uint16_t id, uint16_t seq_num);
         void SendToNetwork(const uint8_t *buf, size_t len);
-        void RecvFromNetwork(uint8_t *buf, size_t len);
+        bool RecvFromNetwork(uint8_t *buf, size_t len);
+        void WaitForIngress();
+        void NextIngressFrame();
+        void UpdateIngressFull();
+        void FillIngressPool();
+        void RingDoorbell();
+        int DrainChannel();
         void HandleIngressArp();
         void HandleIngressIcmp(const string &src_mac);
     public:
-        VirtualMachine(string mac, string ip, int tap_fd)
-            : mac(mac), ip(ip), tap_fd(tap_fd) { Init(); }
+        VirtualMachine(string mac, string ip, int tap_fd, int doorbell_fd, int cpu = -1)
+            : mac(mac), ip(ip), tap_fd(tap_fd), cpu(cpu), channel(NULL),
+              doorbell_fd(doorbell_fd) { Init(); }
+        VirtualMachine(string mac, string ip, ShmChannel *channel, int cpu = -1)
+            : mac(mac), ip(ip), tap_fd(-1), cpu(cpu), channel(channel),
+              doorbell_fd(-1) { Init(); }
         ~VirtualMachine() { Deinit(); }
         void Ping(const string& ip);
-        void SendToVm(const uint8_t *buf, size_t len);
+        bool Ping(const string& ip, chrono::milliseconds timeout, double *rtt_ms);
+        bool SendToVm(const uint8_t *buf, size_t len);
+        bool IsIngressThrottled() const { return ingress_full && ingress_backpressure; }
+        void SetIngressPolicy(const IngressPolicy &policy);
+        IngressStats GetIngressStats() const;
+        void SetBusyPoll(chrono::microseconds budget) { busy_poll_us = budget.count(); }
+        PollStats GetPollStats() const { return poll_counters.Snapshot(); }
+        PollStats GetChannelPollStats() const { return channel_poll_counters.Snapshot(); }
+
+        // Called by the hypervisor to drain the egress queue
+        int GetDoorbellFd() const { return doorbell_fd; }
+        void AckDoorbell();
+        bool HasEgress() const { return egress_pending > 0; }
+        void SetEgressPolled(bool polled) { egress_polled = polled; }
+        int FlushEgress(bool *blocked,
+                        const function<bool(const uint8_t *, size_t)> &intercept);
+        EgressStats GetEgressStats() const;
 };
 
 #endif
@@ -0,0 +1,164 @@
+#include <cpu_util.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h> // For opendir()
+#include <unistd.h> // For syscall()
+#include <sys/syscall.h>
+#include <linux/mempolicy.h> // For MPOL_PREFERRED
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+/**
+ * Pin a thread to a single CPU.
+ *
+ * @param t[in]   the thread to pin
+ * @param cpu[in] the CPU to pin to
+ * @return 0 on success, an error number otherwise
+ */
+int CpuUtil::PinThread(thread &t, int cpu) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int err = pthread_setaffinity_np(t.native_handle(), sizeof(cpus), &cpus);
+    if (err != 0) {
+        fprintf(stderr, "Failed to pin thread to CPU %d: %s\n", cpu, strerror(err));
+    }
+    return err;
+}
+
+/**
+ * Pin the calling thread to a single CPU.
+ *
+ * @param cpu[in] the CPU to pin to
+ * @return 0 on success, an error number otherwise
+ */
+int CpuUtil::PinCurrentThread(int cpu) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err != 0) {
+        fprintf(stderr, "Failed to pin thread to CPU %d: %s\n", cpu, strerror(err));
+    }
+    return err;
+}
+
+/**
+ * Get the NUMA node a CPU belongs to.
+ *
+ * @param cpu[in] the CPU
+ * @return the NUMA node, or -1 if the system does not expose NUMA topology
+ */
+int CpuUtil::GetNumaNode(int cpu) {
+    string path = "/sys/devices/system/cpu/cpu" + to_string(cpu);
+    DIR *dir = opendir(path.c_str());
+    if (dir == NULL) {
+        return -1;
+    }
+    int node = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && isdigit(entry->d_name[4])) {
+            node = stoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/**
+ * Read a CPU list file of sysfs.
+ *
+ * @param path[in] path of the file, e.g. a node's cpulist
+ * @return the CPUs in the list, empty if the file does not exist
+ */
+static vector<int> ReadCpuList(const string &path) {
+    vector<int> cpus;
+    ifstream in(path);
+    string list;
+    if (!getline(in, list)) {
+        return cpus;
+    }
+    // The list looks like "0-3,8-11"
+    stringstream ss(list);
+    string token;
+    while (getline(ss, token, ',')) {
+        size_t dash = token.find('-');
+        int first = stoi(token.substr(0, dash));
+        int last = dash == string::npos ? first : stoi(token.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+/**
+ * Drop the CPUs the calling thread may not run on, e.g. outside its cgroup
+ * cpuset or taskset mask, as pinning to them fails.
+ *
+ * @param cpus[in] the CPUs
+ * @return the CPUs that are allowed, all of them if the mask is unknown
+ */
+static vector<int> KeepAllowedCpus(const vector<int> &cpus) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity()");
+        return cpus;
+    }
+    vector<int> kept;
+    for (int cpu : cpus) {
+        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+            kept.push_back(cpu);
+        }
+    }
+    return kept;
+}
+
+/**
+ * Get the CPUs of a NUMA node that the calling thread may run on.
+ *
+ * @param node[in] the NUMA node
+ * @return the CPUs of the node, empty if the node does not exist
+ */
+vector<int> CpuUtil::GetNodeCpus(int node) {
+    if (node < 0) {
+        return vector<int>();
+    }
+    return KeepAllowedCpus(ReadCpuList("/sys/devices/system/node/node" + to_string(node) + "/cpulist"));
+}
+
+/**
+ * Get the CPUs that are online and that the calling thread may run on.
+ *
+ * @return the online CPUs, empty if sysfs does not list them
+ */
+vector<int> CpuUtil::GetOnlineCpus() {
+    return KeepAllowedCpus(ReadCpuList("/sys/devices/system/cpu/online"));
+}
+
+/**
+ * Make the calling thread prefer allocating memory on a NUMA node.
+ * The kernel falls back to other nodes when the node runs out of memory.
+ *
+ * @param node[in] the NUMA node
+ * @return 0 on success, -1 otherwise
+ */
+int CpuUtil::SetPreferredNode(int node) {
+    unsigned long mask;
+    if (node < 0 || node >= (int)(sizeof(mask) * 8)) {
+        return -1;
+    }
+    mask = 1UL << node;
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8) < 0) {
+        perror("set_mempolicy()");
+        return -1;
+    }
+    return 0;
+}
@@ -1,4 +1,6 @@
 #include <hypervisor.h>
+#include <arp_util.h>
+#include <arpa/inet.h> // For ntohs()
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h> // For open()
@@ -8,18 +10,93 @@
 #include <unistd.h> // For close()
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/filter.h> // For sock_filter
+#include <linux/sockios.h> // For SIOCBRADDIF
+#include <sys/socket.h>
+#include <sys/syscall.h> // For SYS_pidfd_open
+#include <sys/wait.h> // For waitpid()
+#include <sys/eventfd.h>
+#include <signal.h> // For kill()
+#include <algorithm> // For remove()
+
+/**
+ * Attach a classic BPF filter to a TAP so that the kernel only delivers the
+ * frames a VM handles:
+ *   - ARP whose target IP address is the VM
+ *   - IPv4 to the IP address of the VM, sent to its MAC or broadcast
+ * Everything else, e.g. IPv6 or traffic for other VMs, is dropped before it
+ * costs a read(), a copy and a wake-up.
+ *
+ * @param fd[in]  file descriptor of the TAP interface
+ * @param mac[in] MAC address of the VM
+ * @param ip[in]  IP address of the VM
+ * @return 0 on success, negative value on failure
+ */
+static int AttachTapFilter(int fd, const string &mac, const string &ip) {
+    uint8_t mac_bytes[ETH_ALEN];
+    uint8_t ip_bytes[IPV4_ALEN];
+    EthUtil::MacStringToBytes(mac, mac_bytes);
+    IpUtil::IpStringToBytes(ip, ip_bytes);
+    // BPF loads are in host byte order. Shift unsigned, a byte >= 0x80
+    // shifted by 24 overflows the int it would otherwise be promoted to.
+    uint32_t ip_word = ((uint32_t) ip_bytes[0] << 24) | ((uint32_t) ip_bytes[1] << 16) |
+                       ((uint32_t) ip_bytes[2] << 8) | ip_bytes[3];
+    uint32_t mac_hi = ((uint32_t) mac_bytes[0] << 8) | mac_bytes[1];
+    uint32_t mac_lo = ((uint32_t) mac_bytes[2] << 24) | ((uint32_t) mac_bytes[3] << 16) |
+                      ((uint32_t) mac_bytes[4] << 8) | mac_bytes[5];
+
+    // Offsets into the frame, there is no packet information header
+    const uint32_t kEthProto = offsetof(struct eth_hdr, h_proto);
+    const uint32_t kArpTargetIp = ETH_HDR_LEN + ARP_HDR_LEN + offsetof(struct arp_ipv4, arp_tip);
+    const uint32_t kIpDstAddr = ETH_HDR_LEN + offsetof(struct ipv4_hdr, dst_addr);
+
+    // Jump offsets are relative to the next instruction, 14 is accept and 15 is drop
+    struct sock_filter code[] = {
+        /*  0 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, kEthProto),
+        /*  1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_ARP, 0, 2),
+        /*  2 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, kArpTargetIp),
+        /*  3 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ip_word, 10, 11),
+        /*  4 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 10),
+        /*  5 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, kIpDstAddr),
+        /*  6 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ip_word, 0, 8),
+        // Destination MAC is the VM...
+        /*  7 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 2),
+        /*  8 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, mac_lo, 0, 2),
+        /*  9 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 0),
+        /* 10 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, mac_hi, 3, 4),
+        // ...or broadcast
+        /* 11 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xFFFFFFFF, 0, 3),
+        /* 12 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 0),
+        /* 13 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xFFFF, 0, 1),
+        /* 14 */ BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+        /* 15 */ BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+
+    int err;
+    if ((err = ioctl(fd, TUNATTACHFILTER, &prog)) < 0) {
+        perror("Failed to attach TAP filter");
+    }
+    return err;
+}
 
 /**
  * Get the file descriptor of a TAP interface.
  * If the TAP of given name does not exist, it will be created.
  *
- * @param name[in] name of the TAP interface
+ * @param name[in]   name of the TAP interface
+ * @param mac[in]    MAC address of the VM using the TAP
+ * @param ip[in]     IP address of the VM using the TAP
+ * @param filter[in] whether to drop frames the VM does not handle in the kernel
  * @return file descriptor of the TAP interface
  */
-static int GetTapFd(const string &name) {
+static int GetTapFd(const string &name, const string &mac, const string &ip, bool filter) {
     int fd, err;
 
-    if ((fd = open("/dev/net/tun", O_RDWR)) < 0) {
+    // Close-on-exec keeps TAPs out of out-of-process VMs
+    if ((fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC)) < 0) {
         perror("Failed to open /dev/net/tun");
         return fd;
     }
@@ -38,40 +115,586 @@ static int GetTapFd(const string &name) {
         perror("Failed to create TAP interface");
         return err;
     }
+
+    // Reads are driven by select() or busy polling, neither may block
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("Failed to set TAP interface non-blocking");
+    }
+
+    // Without the filter the VM still sees everything, so carry on
+    if (filter) {
+        AttachTapFilter(fd, mac, ip);
+    }
     return fd;
 }
 
 /**
- * Build the file descriptor set for select().
+ * Bring a TAP interface up and add it to a bridge.
+ *
+ * @param name[in]   name of the TAP interface
+ * @param bridge[in] name of the bridge
+ * @return 0 on success, negative value on failure
+ */
+static int AddTapToBridge(const string &name, const string &bridge) {
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("socket()");
+        return sock;
+    }
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ - 1);
+    int err = ioctl(sock, SIOCGIFFLAGS, &ifr);
+    if (err == 0) {
+        ifr.ifr_flags |= IFF_UP;
+        err = ioctl(sock, SIOCSIFFLAGS, &ifr);
+    }
+    if (err < 0) {
+        perror("Failed to bring TAP interface up");
+        close(sock);
+        return err;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, bridge.c_str(), IFNAMSIZ - 1);
+    ifr.ifr_ifindex = if_nametoindex(name.c_str());
+    // EBUSY means the TAP is already on a bridge, e.g. set up by run_lab.sh
+    if ((err = ioctl(sock, SIOCBRADDIF, &ifr)) < 0 && errno != EBUSY) {
+        perror("Failed to add TAP interface to bridge");
+    } else {
+        err = 0;
+    }
+    close(sock);
+    return err;
+}
+
+/**
+ * Check whether a file descriptor fits in an fd_set. Descriptors are
+ * reused once closed, so every descriptor select() watches is checked on
+ * its own rather than guessed from the TAP's.
+ *
+ * @param fd[in] the file descriptor
+ * @return true if select() can watch it
+ */
+static bool FitsFdSet(int fd) {
+    if (fd >= FD_SETSIZE) {
+        fprintf(stderr, "Out of select() capacity, fd %d needs FD_SETSIZE above %d\n",
+                fd, FD_SETSIZE);
+        return false;
+    }
+    return true;
+}
+
+#define ARP_FRAME_LEN (ETH_HDR_LEN + ARP_HDR_LEN + ARP_IPV4_LEN)
+
+/**
+ * Get the target IP address of an ARP request.
+ *
+ * @param frame[in] the ethernet frame
+ * @param len[in]   length of the frame
+ * @param tip[out]  target IP address of the request
+ * @return true if the frame is an ARP request
+ */
+static bool GetArpRequestTarget(const uint8_t *frame, size_t len, string *tip) {
+    if (len < ARP_FRAME_LEN) {
+        return false;
+    }
+    const struct eth_hdr *eth_hdr = (const struct eth_hdr *) frame;
+    const struct arp_hdr *arp_hdr = (const struct arp_hdr *)(eth_hdr + 1);
+    if (ntohs(eth_hdr->h_proto) != ETH_P_ARP || ntohs(arp_hdr->arp_op) != ARP_OP_REQUEST) {
+        return false;
+    }
+    const struct arp_ipv4 *arp_ipv4 = (const struct arp_ipv4 *)(arp_hdr + 1);
+    *tip = IpUtil::IpBytesToString(arp_ipv4->arp_tip);
+    return true;
+}
+
+/**
+ * Build the reply to an ARP request.
+ *
+ * @param request[in] the ARP request frame
+ * @param mac[in]     MAC address of the request target
+ * @param reply[out]  the ARP reply frame of ARP_FRAME_LEN bytes
+ */
+static void BuildArpReply(const uint8_t *request, const string &mac, uint8_t *reply) {
+    const struct arp_ipv4 *req = (const struct arp_ipv4 *)(request + ETH_HDR_LEN + ARP_HDR_LEN);
+    string sha = EthUtil::MacBytesToString(req->arp_sha);
+    string sip = IpUtil::IpBytesToString(req->arp_sip);
+    string tip = IpUtil::IpBytesToString(req->arp_tip);
+
+    struct eth_hdr *eth_hdr = (struct eth_hdr *) reply;
+    EthUtil::CreateEtherHeader(mac, sha, ETH_P_ARP, eth_hdr);
+    struct arp_hdr *arp_hdr = (struct arp_hdr *)(eth_hdr + 1);
+    ArpUtil::CreateArpHeader(ARP_OP_REPLY, arp_hdr);
+    struct arp_ipv4 *arp_ipv4 = (struct arp_ipv4 *)(arp_hdr + 1);
+    ArpUtil::CreateArpBody(mac, tip, sha, sip, arp_ipv4);
+}
+
+/**
+ * Build the file descriptor sets for select().
  * It will set the file descriptor of all existing VMs.
  *
- * @param fds[in] the fd_set struct to set
+ * @param rfds[in] the fd_set struct to set for reading
+ * @param wfds[in] the fd_set struct to set for writing
  */
-void Hypervisor::BuildFdSet(fd_set *fds) {
+void Hypervisor::BuildFdSet(fd_set *rfds, fd_set *wfds) {
     lock_guard<std::mutex> lock(vm_map_mutex);
-    FD_ZERO(fds);
+    FD_ZERO(rfds);
+    FD_ZERO(wfds);
     for (auto &kv : vm_map) {
         int fd = kv.first;
-        FD_SET(fd, fds);
+        // Leave frames in the TAP while the VM is not keeping up
+        if (!kv.second->IsIngressThrottled()) {
+            FD_SET(fd, rfds);
+        }
+        FD_SET(kv.second->GetDoorbellFd(), rfds);
+    }
+    for (auto &kv : channel_map) {
+        if (kv.second->IsBroken()) {
+            continue;
+        }
+        // Same for an out-of-process VM with a full ring, it kicks us when it frees a slot
+        if (!ingress_policy.backpressure || !kv.second->IsTxFull()) {
+            FD_SET(kv.first, rfds);
+        }
+        FD_SET(kv.second->GetRxFd(), rfds);
+    }
+    for (auto &kv : pid_map) {
+        FD_SET(kv.first, rfds);
+    }
+    for (int fd : blocked_egress) {
+        FD_SET(fd, wfds);
     }
 }
 
 /**
  * Read data from file descriptors and dispatch it to the VMs.
  *
- * @param fds[in] the fd_set that contains all file descriptors to read from
+ * @param fds[in] the fd_set that contains all file descriptors to read from,
+ *                NULL to try every VM (busy polling)
+ * @return number of frames dispatched
  */
-void Hypervisor::HandleRead(fd_set *fds) {
+int Hypervisor::HandleRead(fd_set *fds) {
     lock_guard<std::mutex> lock(vm_map_mutex);
+    int frames = 0;
     for (auto &kv : vm_map) {
         int fd = kv.first;
-        if (FD_ISSET(fd, fds)) {
-            VirtualMachine *vm = kv.second;
+        VirtualMachine *vm = kv.second;
+        if (fds == NULL ? vm->HasEgress() : FD_ISSET(vm->GetDoorbellFd(), fds)) {
+            if (fds != NULL) {
+                vm->AckDoorbell();
+            }
+            frames += FlushEgress(fd, vm);
+        }
+        if (fds == NULL ? !vm->IsIngressThrottled() : FD_ISSET(fd, fds)) {
             uint8_t buf[BUF_SIZE];
             int len = read(fd, buf, sizeof(buf));
-            vm->SendToVm(buf, len);
+            if (len < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    perror("read()");
+                }
+                continue;
+            }
+            if (!FilterIngressArp(fd, buf, len)) {
+                vm->SendToVm(buf, len);
+            }
+            frames++;
+        }
+    }
+    for (auto &kv : channel_map) {
+        int fd = kv.first;
+        ShmChannel *channel = kv.second;
+        if (channel->IsBroken()) {
+            continue;
+        }
+        if (fds == NULL ? !ingress_policy.backpressure || !channel->IsTxFull()
+                        : FD_ISSET(fd, fds)) {
+            frames += ReadToChannel(fd, channel);
+        }
+        if (fds == NULL || FD_ISSET(channel->GetRxFd(), fds)) {
+            if (fds != NULL) {
+                channel->AckRx();
+            }
+            frames += WriteFromChannel(fd, channel);
+        }
+    }
+    if (fds != NULL) {
+        // A pidfd becomes readable when its VM process exits
+        vector<int> exited;
+        for (auto &kv : pid_map) {
+            if (FD_ISSET(kv.first, fds)) {
+                exited.push_back(kv.first);
+            }
+        }
+        for (int pid_fd : exited) {
+            RemoveRemoteVM(pid_fd);
+        }
+    }
+    return frames;
+}
+
+/**
+ * Retry egress flushes that were blocked on a full TAP.
+ *
+ * @param fds[in] the fd_set that contains the file descriptors ready for writing
+ */
+void Hypervisor::HandleWrite(fd_set *fds) {
+    lock_guard<std::mutex> lock(vm_map_mutex);
+    vector<int> ready;
+    for (int fd : blocked_egress) {
+        if (FD_ISSET(fd, fds)) {
+            ready.push_back(fd);
+        }
+    }
+    for (int fd : ready) {
+        auto it = vm_map.find(fd);
+        if (it != vm_map.end()) {
+            FlushEgress(fd, it->second);
+        } else {
+            WriteFromChannel(fd, channel_map[fd]);
+        }
+    }
+}
+
+/**
+ * Write the egress queue of a VM to its TAP. Must be called with
+ * vm_map_mutex held.
+ *
+ * @param tap_fd[in] the TAP of the VM
+ * @param vm[in]     the VM
+ * @return number of frames written
+ */
+int Hypervisor::FlushEgress(int tap_fd, VirtualMachine *vm) {
+    bool blocked;
+    int frames = vm->FlushEgress(&blocked, [&](const uint8_t *frame, size_t len) {
+        uint8_t reply[ARP_FRAME_LEN];
+        if (!AnswerArp(frame, len, reply)) {
+            return false;
+        }
+        vm->SendToVm(reply, sizeof(reply));
+        return true;
+    });
+    if (blocked) {
+        blocked_egress.insert(tap_fd);
+    } else {
+        blocked_egress.erase(tap_fd);
+    }
+    return frames;
+}
+
+/**
+ * Read a frame from the TAP of an out-of-process VM straight into the shared
+ * ring, so the frame is never copied inside the hypervisor. If the ring is
+ * full, the frame stays in the TAP with back-pressure, or is read and dropped
+ * without. Must be called with vm_map_mutex held.
+ *
+ * @param tap_fd[in]  the TAP of the VM
+ * @param channel[in] the channel to the VM
+ * @return number of frames read
+ */
+int Hypervisor::ReadToChannel(int tap_fd, ShmChannel *channel) {
+    uint8_t *slot = channel->AcquireTx();
+    if (slot == NULL) {
+        if (ingress_policy.backpressure) {
+            return 0;
         }
+        // The VM is not keeping up. Read the frame anyway so it is dropped and counted.
+        uint8_t buf[BUF_SIZE];
+        int len = read(tap_fd, buf, sizeof(buf));
+        if (len > 0 && !FilterIngressArp(tap_fd, buf, len)) {
+            channel->Send(buf, len);
+        }
+        return 0;
+    }
+    int len = read(tap_fd, slot, SHM_SLOT_SIZE);
+    if (len < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("read()");
+        }
+        return 0;
     }
+    if (!FilterIngressArp(tap_fd, slot, len)) {
+        channel->CommitTx(len);
+    }
+    return 1;
+}
+
+/**
+ * Write the frames an out-of-process VM put on the shared ring to its TAP.
+ * If the TAP would block, the remaining frames stay on the ring until the
+ * TAP is writable again. At most a ring's worth of frames is written per
+ * call, so a VM that keeps producing cannot hold up the other VMs.
+ * Must be called with vm_map_mutex held.
+ *
+ * @param tap_fd[in]  the TAP of the VM
+ * @param channel[in] the channel to the VM
+ * @return number of frames written
+ */
+int Hypervisor::WriteFromChannel(int tap_fd, ShmChannel *channel) {
+    int frames = 0;
+    bool blocked = false;
+    uint32_t len;
+    const uint8_t *frame;
+    while (frames < SHM_RING_SLOTS && (frame = channel->PeekRx(&len)) != NULL) {
+        uint8_t reply[ARP_FRAME_LEN];
+        if (AnswerArp(frame, len, reply)) {
+            channel->Send(reply, sizeof(reply));
+        } else if (write(tap_fd, frame, len) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                blocked = true;
+                break;
+            }
+            perror("write()");
+        }
+        channel->ReleaseRx();
+        frames++;
+    }
+    if (blocked) {
+        blocked_egress.insert(tap_fd);
+    } else {
+        blocked_egress.erase(tap_fd);
+        if (frames == SHM_RING_SLOTS) {
+            // Come back for the rest after the other VMs had their turn
+            channel->RearmRx();
+        }
+    }
+    return frames;
+}
+
+/**
+ * Reap an out-of-process VM that exited and release its channel and TAP.
+ * Must be called with vm_map_mutex held.
+ *
+ * @param pid_fd[in] pidfd of the VM process
+ */
+void Hypervisor::RemoveRemoteVM(int pid_fd) {
+    auto it = pid_map.find(pid_fd);
+    pid_t pid = it->second.first;
+    int tap_fd = it->second.second;
+    int status;
+    if (waitpid(pid, &status, WNOHANG) < 0) {
+        perror("waitpid()");
+    }
+    fprintf(stderr, "VM %s process %d exited\n", tap_addr_map[tap_fd].second.c_str(), pid);
+
+    delete channel_map[tap_fd];
+    channel_map.erase(tap_fd);
+    blocked_egress.erase(tap_fd);
+    arp_table.erase(tap_addr_map[tap_fd].second);
+    tap_addr_map.erase(tap_fd);
+    close(tap_fd);
+    close(pid_fd);
+    pid_map.erase(it);
+}
+
+/**
+ * Answer an ARP request sent by a VM if the target is a VM or in the proxy
+ * ARP table, so the request is not broadcast to every TAP on the bridge.
+ * Must be called with vm_map_mutex held.
+ *
+ * @param frame[in]  egress frame of the VM
+ * @param len[in]    length of the frame
+ * @param reply[out] the ARP reply to deliver to the VM, ARP_FRAME_LEN bytes
+ * @return true if the request was answered and must not reach the bridge
+ */
+bool Hypervisor::AnswerArp(const uint8_t *frame, size_t len, uint8_t *reply) {
+    string tip;
+    if (!arp_suppression || !GetArpRequestTarget(frame, len, &tip)) {
+        return false;
+    }
+    auto it = arp_table.find(tip);
+    if (it == arp_table.end()) {
+        it = proxy_arp_table.find(tip);
+        if (it == proxy_arp_table.end()) {
+            return false;
+        }
+    }
+    BuildArpReply(frame, it->second, reply);
+    arp_replied++;
+    return true;
+}
+
+/**
+ * Keep ARP requests arriving on the TAP of a VM away from the VM. Requests
+ * for the VM are answered on its behalf, the rest would be ignored by the VM
+ * and are dropped. Must be called with vm_map_mutex held.
+ *
+ * @param tap_fd[in] the TAP the frame arrived on
+ * @param frame[in]  the frame
+ * @param len[in]    length of the frame
+ * @return true if the frame was consumed and must not reach the VM
+ */
+bool Hypervisor::FilterIngressArp(int tap_fd, const uint8_t *frame, size_t len) {
+    string tip;
+    if (!arp_suppression || !GetArpRequestTarget(frame, len, &tip)) {
+        return false;
+    }
+    const pair<string, string> &addr = tap_addr_map[tap_fd];
+    if (tip != addr.second) {
+        arp_dropped++;
+        return true;
+    }
+    uint8_t reply[ARP_FRAME_LEN];
+    BuildArpReply(frame, addr.first, reply);
+    // A full TAP drops the reply, the requester retries like after any loss
+    if (write(tap_fd, reply, sizeof(reply)) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("write()");
+    }
+    arp_replied++;
+    return true;
+}
+
+/**
+ * Record the addresses of a new VM for ARP suppression.
+ * Must be called with vm_map_mutex held.
+ *
+ * @param tap_fd[in] the TAP of the VM
+ * @param mac[in]    MAC address of the VM
+ * @param ip[in]     IP address of the VM
+ */
+void Hypervisor::AddVmAddr(int tap_fd, const string &mac, const string &ip) {
+    // Compare addresses in the format MacBytesToString() produces
+    uint8_t mac_bytes[ETH_ALEN];
+    EthUtil::MacStringToBytes(mac, mac_bytes);
+    string normalized_mac = EthUtil::MacBytesToString(mac_bytes);
+    tap_addr_map[tap_fd] = make_pair(normalized_mac, ip);
+    arp_table[ip] = normalized_mac;
+}
+
+/**
+ * Enable or disable ARP suppression. When enabled, the hypervisor answers ARP
+ * requests for known VMs and proxy entries in its event loop instead of
+ * broadcasting them to every VM.
+ *
+ * @param enabled[in] whether to suppress ARP broadcasts
+ */
+void Hypervisor::SetArpSuppression(bool enabled) {
+    lock_guard<std::mutex> lock(vm_map_mutex);
+    arp_suppression = enabled;
+}
+
+/**
+ * Answer ARP requests for an address outside the hypervisor.
+ *
+ * @param ip[in]  the IP address
+ * @param mac[in] the MAC address to answer with
+ */
+void Hypervisor::AddProxyArp(const string &ip, const string &mac) {
+    lock_guard<std::mutex> lock(vm_map_mutex);
+    proxy_arp_table[ip] = mac;
+}
+
+/**
+ * Stop answering ARP requests for an address outside the hypervisor.
+ *
+ * @param ip[in] the IP address
+ */
+void Hypervisor::RemoveProxyArp(const string &ip) {
+    lock_guard<std::mutex> lock(vm_map_mutex);
+    proxy_arp_table.erase(ip);
+}
+
+/**
+ * Take a snapshot of the ARP suppression counters.
+ *
+ * @return the current values of the counters
+ */
+ArpSuppressionStats Hypervisor::GetArpSuppressionStats() const {
+    ArpSuppressionStats stats;
+    stats.replied = arp_replied;
+    stats.dropped = arp_dropped;
+    return stats;
+}
+
+/**
+ * Enable or disable in-kernel filtering of the frames delivered to the TAPs,
+ * for existing VMs and VMs created afterwards.
+ *
+ * @param enabled[in] whether to filter
+ */
+void Hypervisor::SetTapFilter(bool enabled) {
+    lock_guard<std::mutex> lock(vm_map_mutex);
+    tap_filter = enabled;
+    for (auto &kv : tap_addr_map) {
+        if (enabled) {
+            AttachTapFilter(kv.first, kv.second.first, kv.second.second);
+        } else {
+            struct sock_fprog prog;
+            memset(&prog, 0, sizeof(prog));
+            if (ioctl(kv.first, TUNDETACHFILTER, &prog) < 0) {
+                perror("Failed to detach TAP filter");
+            }
+        }
+    }
+}
+
+/**
+ * Bring the TAPs of VMs created from now on up and add them to a bridge, so
+ * no per-TAP setup like run_lab.sh is needed.
+ *
+ * @param name[in] name of the bridge, empty to leave TAPs alone
+ */
+void Hypervisor::SetBridge(const string &name) {
+    lock_guard<std::mutex> lock(vm_map_mutex);
+    bridge = name;
+}
+
+/**
+ * Add the TAP of a new VM to the bridge set by SetBridge(), if any.
+ *
+ * @param tap_name[in] name of the TAP interface
+ * @return 0 on success or without a bridge, negative value on failure
+ */
+int Hypervisor::JoinBridge(const string &tap_name) {
+    string name;
+    {
+        lock_guard<std::mutex> lock(vm_map_mutex);
+        name = bridge;
+    }
+    return name.empty() ? 0 : AddTapToBridge(tap_name, name);
+}
+
+/**
+ * Tell VMs whether the hypervisor is polling their egress queues and rings,
+ * so that they can skip kicking it.
+ *
+ * @param polling[in] whether the hypervisor is polling
+ */
+void Hypervisor::SetPeerPolling(bool polling) {
+    lock_guard<std::mutex> lock(vm_map_mutex);
+    for (auto &kv : vm_map) {
+        kv.second->SetEgressPolled(polling);
+    }
+    for (auto &kv : channel_map) {
+        kv.second->SetPolling(polling);
+    }
+}
+
+/**
+ * Spin over the TAP interfaces until a frame arrives or the budget runs out.
+ *
+ * @param budget[in] how long to spin before giving up
+ * @return true if at least one frame was dispatched
+ */
+bool Hypervisor::BusyPoll(chrono::microseconds budget) {
+    auto start = chrono::steady_clock::now();
+    auto deadline = start + budget;
+    bool hit;
+    SetPeerPolling(true);
+    do {
+        hit = HandleRead(NULL) > 0;
+    } while (!hit && chrono::steady_clock::now() < deadline);
+    SetPeerPolling(false);
+    // Make the cleared flags visible before re-checking, see ShmChannel::CommitTx()
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!hit) {
+        // Catch frames published while kicks were suppressed
+        hit = HandleRead(NULL) > 0;
+    }
+    auto spin = chrono::steady_clock::now() - start;
+    poll_counters.AddSpin(chrono::duration_cast<chrono::nanoseconds>(spin).count(), hit);
+    return hit;
 }
 
 /**
@@ -80,14 +703,36 @@ void Hypervisor::HandleRead(fd_set *fds) {
 void Hypervisor::Init() {
     max_fd = -1;
     next_vm_id = 0;
+    busy_poll_us = 0;
+    arp_suppression = false;
+    tap_filter = false;
+    arp_replied = arp_dropped = 0;
     auto loop = [&]() {
+        int busy_hits = 0;
         while (true) {
-            fd_set fds;
-            BuildFdSet(&fds);
+            long budget = busy_poll_us;
+            // Busy polling only looks at the TAPs and rings. Every so often
+            // fall through to select() without blocking, for the events only
+            // it sees, e.g. POLLOUT on a full TAP or a VM process exiting.
+            bool peek = false;
+            if (budget > 0 && BusyPoll(chrono::microseconds(budget))) {
+                if (++busy_hits < BUSY_POLL_SELECT_EVERY) {
+                    continue;
+                }
+                peek = true;
+            }
+            busy_hits = 0;
+            fd_set rfds, wfds;
+            BuildFdSet(&rfds, &wfds);
             struct timeval timeout;
-            timeout.tv_sec = 1;
+            timeout.tv_sec = peek ? 0 : 1;
             timeout.tv_usec = 0;
-            int ret = select(max_fd + 1, &fds, NULL, NULL, &timeout);
+            auto start = chrono::steady_clock::now();
+            int ret = select(max_fd + 1, &rfds, &wfds, NULL, &timeout);
+            if (!peek) {
+                auto sleep = chrono::steady_clock::now() - start;
+                poll_counters.AddSleep(chrono::duration_cast<chrono::nanoseconds>(sleep).count());
+            }
             if (ret < 0) {
                 if (errno == EINTR) {
                     continue;
@@ -97,29 +742,224 @@ void Hypervisor::Init() {
             } else if (ret == 0) {
                 continue;
             }
-            HandleRead(&fds);
+            HandleRead(&rfds);
+            HandleWrite(&wfds);
         }
     };
 
     select_thread = thread(loop);
 }
 
+/**
+ * Pick the CPU for a new VM according to the placement policy.
+ * Must be called with vm_map_mutex held.
+ *
+ * @param vm_id[in] id of the new VM
+ * @return the CPU to pin the VM to, -1 to leave it to the scheduler
+ */
+int Hypervisor::PickVmCpu(int vm_id) {
+    if (!placement.vm_cpus.empty()) {
+        return placement.vm_cpus[vm_id % placement.vm_cpus.size()];
+    }
+    if (placement.hypervisor_cpu < 0) {
+        return -1;
+    }
+    // Co-locate with the select() loop that reads the VM's TAP
+    int node = CpuUtil::GetNumaNode(placement.hypervisor_cpu);
+    vector<int> cpus = CpuUtil::GetNodeCpus(node);
+    if (cpus.empty()) {
+        // No NUMA topology, any CPU is as close as another
+        cpus = CpuUtil::GetOnlineCpus();
+    }
+    // Keep the hypervisor CPU for the select() loop
+    cpus.erase(remove(cpus.begin(), cpus.end(), placement.hypervisor_cpu), cpus.end());
+    if (cpus.empty()) {
+        return -1;
+    }
+    return cpus[vm_id % cpus.size()];
+}
+
+/**
+ * Set the thread placement policy. The hypervisor thread is re-pinned right
+ * away; the VM CPUs apply to VMs created afterwards.
+ *
+ * @param policy[in] the placement policy
+ */
+void Hypervisor::SetPlacementPolicy(const PlacementPolicy &policy) {
+    lock_guard<std::mutex> lock(vm_map_mutex);
+    placement = policy;
+    if (placement.hypervisor_cpu >= 0) {
+        CpuUtil::PinThread(select_thread, placement.hypervisor_cpu);
+    }
+}
+
+/**
+ * Enable or disable busy polling. With a non-zero budget, the hypervisor and
+ * every VM spin for up to the budget waiting for frames before falling back
+ * to a blocking wait. This trades CPU time for wake-up latency.
+ * Out-of-process VMs get the budget when they are created.
+ *
+ * @param budget[in] how long to spin before blocking, 0 to disable
+ */
+void Hypervisor::SetBusyPoll(chrono::microseconds budget) {
+    lock_guard<std::mutex> lock(vm_map_mutex);
+    busy_poll_us = budget.count();
+    for (auto &kv : vm_map) {
+        kv.second->SetBusyPoll(budget);
+    }
+}
+
+/**
+ * Set the bounds and drop policy of the ingress queue of every VM, including
+ * VMs created afterwards. Out-of-process VMs get the policy when they are
+ * created. Back-pressure on their rings applies right away.
+ *
+ * @param policy[in] the ingress policy
+ */
+void Hypervisor::SetIngressPolicy(const IngressPolicy &policy) {
+    lock_guard<std::mutex> lock(vm_map_mutex);
+    ingress_policy = policy;
+    for (auto &kv : vm_map) {
+        kv.second->SetIngressPolicy(policy);
+    }
+}
+
 /**
  * Create a virtual machine.
  *
  * @param mac[in] MAC address of the VM
  * @param ip[in]  IP address of the VM
- * @return pointer to the newly created VM
+ * @return pointer to the newly created VM, NULL on failure
  */
 VirtualMachine *Hypervisor::createVM(const string &mac, const string &ip) {
     int vm_id = next_vm_id++;
     string tap_name = "tap" + to_string(vm_id);
-    int tap_fd = GetTapFd(tap_name);
+    int tap_fd = GetTapFd(tap_name, mac, ip, tap_filter);
+    if (tap_fd < 0) {
+        return NULL;
+    }
+    // An isolated VM is no use, give up if the TAP cannot join the bridge
+    if (!FitsFdSet(tap_fd) || JoinBridge(tap_name) < 0) {
+        close(tap_fd);
+        return NULL;
+    }
+    // Create the doorbell here so a VM is never published without one
+    int doorbell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (doorbell_fd < 0 || !FitsFdSet(doorbell_fd)) {
+        if (doorbell_fd < 0) {
+            perror("eventfd()");
+        } else {
+            close(doorbell_fd);
+        }
+        close(tap_fd);
+        return NULL;
+    }
 
-    VirtualMachine *vm = new VirtualMachine(mac, ip, tap_fd);
     lock_guard<std::mutex> lock(vm_map_mutex);
+    VirtualMachine *vm = new VirtualMachine(mac, ip, tap_fd, doorbell_fd, PickVmCpu(vm_id));
+    vm->SetBusyPoll(chrono::microseconds(busy_poll_us));
+    vm->SetIngressPolicy(ingress_policy);
     vm_map[tap_fd] = vm;
-    max_fd = max(max_fd.load(), tap_fd);
+    AddVmAddr(tap_fd, mac, ip);
+    max_fd = max(max_fd.load(), max(tap_fd, vm->GetDoorbellFd()));
     return vm;
 }
 
+
+/**
+ * Create a virtual machine in a separate process. The VM exchanges frames
+ * with the hypervisor over a shared memory channel, so a misbehaving VM only
+ * takes down its own process.
+ *
+ * @param mac[in]     MAC address of the VM
+ * @param ip[in]      IP address of the VM
+ * @param vm_prog[in] path of the VM program, e.g. ./tap-vm
+ * @param args[in]    extra arguments passed to the VM program
+ * @return pid of the VM process, -1 on failure
+ */
+pid_t Hypervisor::createRemoteVM(const string &mac, const string &ip,
+                                 const string &vm_prog, const vector<string> &args) {
+    int vm_id = next_vm_id++;
+    string tap_name = "tap" + to_string(vm_id);
+    int tap_fd = GetTapFd(tap_name, mac, ip, tap_filter);
+    if (tap_fd < 0) {
+        return -1;
+    }
+    if (!FitsFdSet(tap_fd) || JoinBridge(tap_name) < 0) {
+        close(tap_fd);
+        return -1;
+    }
+
+    int mem_fd, tx_kick_fd, rx_kick_fd;
+    ShmChannel *channel = ShmChannel::Create(&mem_fd, &tx_kick_fd, &rx_kick_fd);
+    if (channel == NULL) {
+        close(tap_fd);
+        return -1;
+    }
+    // Of the channel, select() only watches the eventfd the VM kicks
+    if (!FitsFdSet(channel->GetRxFd())) {
+        delete channel;
+        close(tap_fd);
+        return -1;
+    }
+
+    // The VM process cannot be reached by the setters, hand it the current settings
+    IngressPolicy policy;
+    {
+        lock_guard<std::mutex> lock(vm_map_mutex);
+        policy = ingress_policy;
+    }
+    // Build argv before fork(), the child may only make async-signal-safe calls
+    vector<string> strs = {vm_prog, "-p", to_string(busy_poll_us.load()),
+                           "-f", to_string(policy.max_frames), "-b", to_string(policy.max_bytes),
+                           "-d", policy.drop_policy == INGRESS_DROP_PRIORITY ? "priority" : "tail"};
+    if (!policy.backpressure) {
+        strs.push_back("-n");
+    }
+    strs.insert(strs.end(), {mac, ip, to_string(mem_fd),
+                             to_string(tx_kick_fd), to_string(rx_kick_fd)});
+    strs.insert(strs.end(), args.begin(), args.end());
+    vector<char *> argv;
+    for (auto &str : strs) {
+        argv.push_back(&str[0]);
+    }
+    argv.push_back(NULL);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork()");
+        delete channel;
+        close(tap_fd);
+        return -1;
+    } else if (pid == 0) {
+        // Hand the channel over to the VM program
+        fcntl(mem_fd, F_SETFD, 0);
+        fcntl(tx_kick_fd, F_SETFD, 0);
+        fcntl(rx_kick_fd, F_SETFD, 0);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    // Watch for the VM exiting so its channel and TAP can be released
+    int pid_fd = syscall(SYS_pidfd_open, pid, 0);
+    if (pid_fd < 0) {
+        perror("pidfd_open()");
+    } else if (!FitsFdSet(pid_fd)) {
+        // Too late to keep the VM from starting, stop it again
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(pid_fd);
+        delete channel;
+        close(tap_fd);
+        return -1;
+    }
+
+    lock_guard<std::mutex> lock(vm_map_mutex);
+    channel_map[tap_fd] = channel;
+    if (pid_fd >= 0) {
+        pid_map[pid_fd] = make_pair(pid, tap_fd);
+    }
+    AddVmAddr(tap_fd, mac, ip);
+    max_fd = max(max_fd.load(), max(max(tap_fd, channel->GetRxFd()), pid_fd));
+    return pid;
+}
@@ -0,0 +1,327 @@
+#include <eth_util.h>
+#include <ip_util.h>
+#include <arp_util.h>
+#include <icmp_util.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+using namespace std;
+
+/**
+ * Microbenchmarks for the per-packet protocol helpers.
+ *
+ * Usage: microbench [name filter]
+ *
+ * Each benchmark is calibrated to run for about kBatchNs per batch, warmed up
+ * for one batch, then run for kRepetitions batches. The median batch is
+ * reported as ns/op, heap allocations/op and, when perf_event_open() is
+ * permitted, cycles/op and instructions/op.
+ */
+
+static const uint64_t kBatchNs = 10 * 1000 * 1000;
+static const int kRepetitions = 11;
+
+/*
+ * Count heap allocations made by the code under test.
+ */
+static uint64_t alloc_count = 0;
+
+void *operator new(size_t size) {
+    alloc_count++;
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == NULL) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+/*
+ * Keep the compiler from optimising away a result.
+ */
+template <typename T>
+static inline void DoNotOptimize(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/**
+ * A hardware counter read through perf_event_open().
+ */
+class PerfCounter {
+    private:
+        int fd;
+    public:
+        PerfCounter(uint64_t config) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+        ~PerfCounter() {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        bool Available() const { return fd >= 0; }
+        void Start() {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+        uint64_t Stop() {
+            uint64_t value = 0;
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(fd, &value, sizeof(value)) != sizeof(value)) {
+                    value = 0;
+                }
+            }
+            return value;
+        }
+};
+
+struct BatchResult {
+    double ns;
+    double allocs;
+    double cycles;
+    double instructions;
+};
+
+static PerfCounter *cycles_counter;
+static PerfCounter *instructions_counter;
+static const char *name_filter;
+
+/**
+ * Run op iters times and return the per-op cost.
+ */
+template <typename Op>
+static BatchResult RunBatch(Op &op, uint64_t iters) {
+    uint64_t allocs = alloc_count;
+    cycles_counter->Start();
+    instructions_counter->Start();
+    auto start = chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iters; i++) {
+        op();
+    }
+    auto end = chrono::steady_clock::now();
+    uint64_t instructions = instructions_counter->Stop();
+    uint64_t cycles = cycles_counter->Stop();
+
+    BatchResult result;
+    result.ns = (double) chrono::duration_cast<chrono::nanoseconds>(end - start).count() / iters;
+    result.allocs = (double) (alloc_count - allocs) / iters;
+    result.cycles = (double) cycles / iters;
+    result.instructions = (double) instructions / iters;
+    return result;
+}
+
+/**
+ * Calibrate, warm up and measure a benchmark, then print one result line.
+ *
+ * @param name[in] name of the benchmark
+ * @param op[in]   the operation to measure
+ */
+template <typename Op>
+static void Bench(const char *name, Op op) {
+    if (name_filter != NULL && strstr(name, name_filter) == NULL) {
+        return;
+    }
+
+    // Calibrate the batch size, which also warms up caches and predictors
+    uint64_t iters = 1;
+    while (true) {
+        BatchResult result = RunBatch(op, iters);
+        if (result.ns * iters >= kBatchNs || iters >= (1ULL << 30)) {
+            break;
+        }
+        iters *= 2;
+    }
+
+    vector<BatchResult> results;
+    for (int i = 0; i < kRepetitions; i++) {
+        results.push_back(RunBatch(op, iters));
+    }
+    sort(results.begin(), results.end(),
+         [](const BatchResult &a, const BatchResult &b) { return a.ns < b.ns; });
+    const BatchResult &median = results[kRepetitions / 2];
+
+    printf("%-28s %10.1f %10.1f %10.2f", name, median.ns, results[0].ns, median.allocs);
+    if (cycles_counter->Available()) {
+        printf(" %10.1f", median.cycles);
+    } else {
+        printf(" %10s", "-");
+    }
+    if (instructions_counter->Available()) {
+        printf(" %10.1f", median.instructions);
+    } else {
+        printf(" %10s", "-");
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    name_filter = argc > 1 ? argv[1] : NULL;
+    cycles_counter = new PerfCounter(PERF_COUNT_HW_CPU_CYCLES);
+    instructions_counter = new PerfCounter(PERF_COUNT_HW_INSTRUCTIONS);
+    if (!cycles_counter->Available()) {
+        printf("perf_event_open() is not available, hardware counters are disabled\n");
+    }
+    printf("%-28s %10s %10s %10s %10s %10s\n",
+           "benchmark", "ns/op", "min ns/op", "allocs/op", "cycles/op", "instr/op");
+
+    const string mac = "00:11:22:33:44:55";
+    const string peer_mac = "66:77:88:99:aa:bb";
+    const string ip = "192.168.1.1";
+    const string peer_ip = "192.168.100.200";
+    uint8_t mac_bytes[ETH_ALEN];
+    uint8_t ip_bytes[IPV4_ALEN];
+    EthUtil::MacStringToBytes(mac, mac_bytes);
+    IpUtil::IpStringToBytes(peer_ip, ip_bytes);
+
+    /*
+     * Address conversions
+     */
+    Bench("EthUtil::MacStringToBytes", [&]() {
+        uint8_t buf[ETH_ALEN];
+        EthUtil::MacStringToBytes(mac, buf);
+        DoNotOptimize(buf);
+    });
+    Bench("EthUtil::MacBytesToString", [&]() {
+        string str = EthUtil::MacBytesToString(mac_bytes);
+        DoNotOptimize(str);
+    });
+    Bench("IpUtil::IpStringToBytes", [&]() {
+        uint8_t buf[IPV4_ALEN];
+        IpUtil::IpStringToBytes(peer_ip, buf);
+        DoNotOptimize(buf);
+    });
+    Bench("IpUtil::IpBytesToString", [&]() {
+        string str = IpUtil::IpBytesToString(ip_bytes);
+        DoNotOptimize(str);
+    });
+
+    /*
+     * Header builders
+     */
+    struct ipv4_hdr ipv4_hdr;
+    IpUtil::CreateIpV4Header(ip, peer_ip, ICMP_HDR_LEN + ICMP_ECHO_LEN, &ipv4_hdr);
+    Bench("IpUtil::CalculateChecksum", [&]() {
+        uint16_t checksum = IpUtil::CalculateChecksum((uint8_t *) &ipv4_hdr, IPV4_HDR_LEN);
+        DoNotOptimize(checksum);
+    });
+    Bench("ArpUtil::CreateArpHeader", [&]() {
+        struct arp_hdr arp_hdr;
+        ArpUtil::CreateArpHeader(ARP_OP_REQUEST, &arp_hdr);
+        DoNotOptimize(arp_hdr);
+    });
+    Bench("ArpUtil::CreateArpBody", [&]() {
+        struct arp_ipv4 arp_ipv4;
+        ArpUtil::CreateArpBody(mac, ip, kEthBroadcastAddr, peer_ip, &arp_ipv4);
+        DoNotOptimize(arp_ipv4);
+    });
+    Bench("IcmpUtil::CreateIcmpEcho", [&]() {
+        uint8_t buf[ICMP_HDR_LEN + ICMP_ECHO_LEN];
+        IcmpUtil::CreateIcmpEcho(ICMP_ECHO_REQUEST, (struct icmp_hdr *) buf, 1, 1);
+        DoNotOptimize(buf);
+    });
+
+    /*
+     * Whole frames, built and parsed the way VirtualMachine does it
+     */
+    uint8_t arp_frame[ETH_HDR_LEN + ARP_HDR_LEN + ARP_IPV4_LEN];
+    auto build_arp = [&]() {
+        struct eth_hdr *eth_hdr = (struct eth_hdr *) arp_frame;
+        EthUtil::CreateEtherHeader(mac, kEthBroadcastAddr, ETH_P_ARP, eth_hdr);
+        struct arp_hdr *arp_hdr = (struct arp_hdr *)(eth_hdr + 1);
+        ArpUtil::CreateArpHeader(ARP_OP_REQUEST, arp_hdr);
+        struct arp_ipv4 *arp_ipv4 = (struct arp_ipv4 *)(arp_hdr + 1);
+        ArpUtil::CreateArpBody(mac, ip, kEthBroadcastAddr, peer_ip, arp_ipv4);
+        DoNotOptimize(arp_frame);
+    };
+    Bench("frame: build ARP request", build_arp);
+    Bench("frame: parse ARP request", [&]() {
+        struct eth_hdr *eth_hdr = (struct eth_hdr *) arp_frame;
+        string src_mac = EthUtil::MacBytesToString(eth_hdr->h_source);
+        uint16_t proto = ntohs(eth_hdr->h_proto);
+        struct arp_hdr *arp_hdr = (struct arp_hdr *)(eth_hdr + 1);
+        uint16_t op = ntohs(arp_hdr->arp_op);
+        struct arp_ipv4 *arp_ipv4 = (struct arp_ipv4 *)(arp_hdr + 1);
+        string sha = EthUtil::MacBytesToString(arp_ipv4->arp_sha);
+        string sip = IpUtil::IpBytesToString(arp_ipv4->arp_sip);
+        string tip = IpUtil::IpBytesToString(arp_ipv4->arp_tip);
+        DoNotOptimize(src_mac);
+        DoNotOptimize(proto);
+        DoNotOptimize(op);
+        DoNotOptimize(sha);
+        DoNotOptimize(sip);
+        DoNotOptimize(tip);
+    });
+
+    uint8_t icmp_frame[ETH_HDR_LEN + IPV4_HDR_LEN + ICMP_HDR_LEN + ICMP_ECHO_LEN];
+    auto build_icmp = [&]() {
+        struct eth_hdr *eth_hdr = (struct eth_hdr *) icmp_frame;
+        EthUtil::CreateEtherHeader(mac, peer_mac, ETH_P_IP, eth_hdr);
+        struct ipv4_hdr *ipv4_hdr = (struct ipv4_hdr *)(eth_hdr + 1);
+        IpUtil::CreateIpV4Header(ip, peer_ip, ICMP_HDR_LEN + ICMP_ECHO_LEN, ipv4_hdr);
+        struct icmp_hdr *icmp_hdr = (struct icmp_hdr *)(ipv4_hdr + 1);
+        IcmpUtil::CreateIcmpEcho(ICMP_ECHO_REQUEST, icmp_hdr, 1, 1);
+        DoNotOptimize(icmp_frame);
+    };
+    Bench("frame: build ICMP echo", build_icmp);
+    Bench("frame: parse ICMP echo", [&]() {
+        struct eth_hdr *eth_hdr = (struct eth_hdr *) icmp_frame;
+        string src_mac = EthUtil::MacBytesToString(eth_hdr->h_source);
+        uint16_t proto = ntohs(eth_hdr->h_proto);
+        struct ipv4_hdr *ipv4_hdr = (struct ipv4_hdr *)(eth_hdr + 1);
+        string dst_ip = IpUtil::IpBytesToString(ipv4_hdr->dst_addr);
+        string src_ip = IpUtil::IpBytesToString(ipv4_hdr->src_addr);
+        struct icmp_hdr *icmp_hdr = (struct icmp_hdr *)(ipv4_hdr + 1);
+        struct icmp_echo *icmp_echo = (struct icmp_echo *)(icmp_hdr + 1);
+        DoNotOptimize(src_mac);
+        DoNotOptimize(proto);
+        DoNotOptimize(dst_ip);
+        DoNotOptimize(src_ip);
+        DoNotOptimize(icmp_hdr->icmp_type);
+        DoNotOptimize(icmp_echo->id);
+    });
+    Bench("frame: ICMP echo round trip", [&]() {
+        // Build a request, parse it and build the reply like HandleIngressIcmp
+        build_icmp();
+        struct eth_hdr *eth_hdr = (struct eth_hdr *) icmp_frame;
+        string src_mac = EthUtil::MacBytesToString(eth_hdr->h_source);
+        struct ipv4_hdr *ipv4_hdr = (struct ipv4_hdr *)(eth_hdr + 1);
+        string src_ip = IpUtil::IpBytesToString(ipv4_hdr->src_addr);
+        struct icmp_echo *icmp_echo = (struct icmp_echo *)((struct icmp_hdr *)(ipv4_hdr + 1) + 1);
+        uint8_t reply[sizeof(icmp_frame)];
+        struct eth_hdr *reply_eth = (struct eth_hdr *) reply;
+        EthUtil::CreateEtherHeader(peer_mac, src_mac, ETH_P_IP, reply_eth);
+        struct ipv4_hdr *reply_ip = (struct ipv4_hdr *)(reply_eth + 1);
+        IpUtil::CreateIpV4Header(peer_ip, src_ip, ICMP_HDR_LEN + ICMP_ECHO_LEN, reply_ip);
+        IcmpUtil::CreateIcmpEcho(ICMP_ECHO_REPLY, (struct icmp_hdr *)(reply_ip + 1),
+                                 icmp_echo->id, icmp_echo->seq_num);
+        DoNotOptimize(reply);
+    });
+    return 0;
+}
@@ -0,0 +1,41 @@
+#include <poll_stats.h>
+
+/**
+ * Account a busy-poll round.
+ *
+ * @param ns[in]  time spent spinning in nanoseconds
+ * @param hit[in] whether the round found work before the budget ran out
+ */
+void PollCounters::AddSpin(uint64_t ns, bool hit) {
+    spin_ns += ns;
+    if (hit) {
+        spin_hits++;
+    } else {
+        spin_misses++;
+    }
+}
+
+/**
+ * Account a blocking wait.
+ *
+ * @param ns[in] time spent blocked in nanoseconds
+ */
+void PollCounters::AddSleep(uint64_t ns) {
+    sleep_ns += ns;
+    sleeps++;
+}
+
+/**
+ * Take a snapshot of the counters.
+ *
+ * @return the current values of the counters
+ */
+PollStats PollCounters::Snapshot() const {
+    PollStats stats;
+    stats.spin_ns = spin_ns;
+    stats.sleep_ns = sleep_ns;
+    stats.spin_hits = spin_hits;
+    stats.spin_misses = spin_misses;
+    stats.sleeps = sleeps;
+    return stats;
+}
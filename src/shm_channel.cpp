@@ -0,0 +1,259 @@
+#include <shm_channel.h>
+#include <sys/mman.h> // For memfd_create() and mmap()
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#define SHM_CHANNEL_SIZE (2 * sizeof(struct shm_ring))
+
+/**
+ * Map the shared rings of a channel.
+ *
+ * @param mem_fd[in] the memfd backing the rings
+ * @return address of the two rings, NULL on failure
+ */
+static struct shm_ring *MapRings(int mem_fd) {
+    void *mem = mmap(NULL, SHM_CHANNEL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap()");
+        return NULL;
+    }
+    return (struct shm_ring *) mem;
+}
+
+/**
+ * Create a channel on the hypervisor side. The returned file descriptors are
+ * what the VM process needs to pass to Attach(). They are close-on-exec, so
+ * the caller must clear FD_CLOEXEC in the child before exec.
+ *
+ * @param vm_mem_fd[out]     memfd backing the rings
+ * @param vm_tx_kick_fd[out] eventfd the VM writes after producing
+ * @param vm_rx_kick_fd[out] eventfd the VM waits on for frames
+ * @return the hypervisor side of the channel, NULL on failure
+ */
+ShmChannel *ShmChannel::Create(int *vm_mem_fd, int *vm_tx_kick_fd, int *vm_rx_kick_fd) {
+    int mem_fd = memfd_create("tap-lab-vring", MFD_CLOEXEC);
+    if (mem_fd < 0) {
+        perror("memfd_create()");
+        return NULL;
+    }
+    if (ftruncate(mem_fd, SHM_CHANNEL_SIZE) < 0) {
+        perror("ftruncate()");
+        close(mem_fd);
+        return NULL;
+    }
+    struct shm_ring *rings = MapRings(mem_fd);
+    int to_vm_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int to_host_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (rings == NULL || to_vm_fd < 0 || to_host_fd < 0) {
+        perror("Failed to create shared memory channel");
+        if (rings != NULL) {
+            munmap(rings, SHM_CHANNEL_SIZE);
+        }
+        if (to_vm_fd >= 0) {
+            close(to_vm_fd);
+        }
+        if (to_host_fd >= 0) {
+            close(to_host_fd);
+        }
+        close(mem_fd);
+        return NULL;
+    }
+    *vm_mem_fd = mem_fd;
+    *vm_tx_kick_fd = to_host_fd;
+    *vm_rx_kick_fd = to_vm_fd;
+    // Ring 0 carries frames to the VM, ring 1 carries frames from the VM
+    return new ShmChannel(mem_fd, to_vm_fd, to_host_fd, &rings[0], &rings[1]);
+}
+
+/**
+ * Attach to a channel created by the hypervisor. Used in the VM process.
+ *
+ * @param mem_fd[in]     memfd backing the rings
+ * @param tx_kick_fd[in] eventfd to write after producing
+ * @param rx_kick_fd[in] eventfd to wait on for frames
+ * @return the VM side of the channel, NULL on failure
+ */
+ShmChannel *ShmChannel::Attach(int mem_fd, int tx_kick_fd, int rx_kick_fd) {
+    struct shm_ring *rings = MapRings(mem_fd);
+    if (rings == NULL) {
+        return NULL;
+    }
+    return new ShmChannel(mem_fd, tx_kick_fd, rx_kick_fd, &rings[1], &rings[0]);
+}
+
+/**
+ * Unmap the rings and close the file descriptors of the channel.
+ */
+ShmChannel::~ShmChannel() {
+    // The rings were mapped together, the lower one is the start of the mapping
+    munmap(tx_ring < rx_ring ? tx_ring : rx_ring, SHM_CHANNEL_SIZE);
+    close(mem_fd);
+    close(tx_kick_fd);
+    close(rx_kick_fd);
+}
+
+/**
+ * Get the next free slot of the tx ring so a frame can be built in place.
+ *
+ * @return the slot buffer of SHM_SLOT_SIZE bytes, NULL if the ring is full
+ */
+uint8_t *ShmChannel::AcquireTx() {
+    // A tail ahead of head is bogus, treat it as full rather than free
+    if (tx_head - tx_ring->tail.load(memory_order_acquire) >= SHM_RING_SLOTS) {
+        return NULL;
+    }
+    return tx_ring->slots[tx_head % SHM_RING_SLOTS].data;
+}
+
+/**
+ * Publish the slot returned by AcquireTx() and kick the peer unless it is
+ * polling.
+ *
+ * @param len[in] length of the frame in the slot
+ */
+void ShmChannel::CommitTx(uint32_t len) {
+    tx_ring->slots[tx_head % SHM_RING_SLOTS].len = len;
+    tx_ring->head.store(++tx_head, memory_order_release);
+    // Order the head store before the no_notify load. Otherwise both can be
+    // reordered against the consumer's SetPolling(false) and re-check, and
+    // the consumer goes to sleep on a frame nobody kicks it for.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!tx_ring->no_notify.load(memory_order_relaxed)) {
+        Kick();
+    }
+}
+
+/**
+ * Signal the peer's eventfd.
+ */
+void ShmChannel::Kick() {
+    uint64_t one = 1;
+    if (write(tx_kick_fd, &one, sizeof(one)) < 0) {
+        perror("Failed to kick shared memory channel");
+    }
+}
+
+/**
+ * Copy a frame into the tx ring.
+ *
+ * @param buf[in] the frame
+ * @param len[in] length of the frame
+ * @return true if the frame was queued, false if it was dropped
+ */
+bool ShmChannel::Send(const uint8_t *buf, size_t len) {
+    uint8_t *slot = AcquireTx();
+    if (slot == NULL || len > SHM_SLOT_SIZE) {
+        tx_drops++;
+        return false;
+    }
+    memcpy(slot, buf, len);
+    CommitTx(len);
+    return true;
+}
+
+/**
+ * Get the oldest frame of the rx ring without copying it. Frames longer than
+ * a slot are dropped. A head more than a ring ahead of the tail breaks the
+ * channel for good, as the peer is not following the protocol.
+ *
+ * @param len[out] length of the frame, at most SHM_SLOT_SIZE
+ * @return the frame, NULL if the ring is empty or the channel is broken
+ */
+const uint8_t *ShmChannel::PeekRx(uint32_t *len) {
+    while (!broken) {
+        uint32_t head = rx_ring->head.load(memory_order_acquire);
+        if (head == rx_tail) {
+            return NULL;
+        }
+        if (head - rx_tail > SHM_RING_SLOTS) {
+            fprintf(stderr, "Shared memory channel corrupted, head %u tail %u\n",
+                    head, rx_tail);
+            rx_errors++;
+            broken = true;
+            return NULL;
+        }
+        struct shm_slot *slot = &rx_ring->slots[rx_tail % SHM_RING_SLOTS];
+        // Read the length once, the peer may rewrite it after the check
+        uint32_t slot_len = *(volatile uint32_t *) &slot->len;
+        if (slot_len <= SHM_SLOT_SIZE) {
+            *len = slot_len;
+            return slot->data;
+        }
+        rx_errors++;
+        ReleaseRx();
+    }
+    return NULL;
+}
+
+/**
+ * Return the frame from PeekRx() to the producer. If the ring was full, kick
+ * the producer as it may be waiting for room.
+ */
+void ShmChannel::ReleaseRx() {
+    rx_ring->tail.store(++rx_tail, memory_order_release);
+    // Pairs with the fence in CommitTx(): either the producer sees the new
+    // tail, or we see the head that filled the ring
+    atomic_thread_fence(memory_order_seq_cst);
+    if (rx_ring->head.load(memory_order_relaxed) - (rx_tail - 1) == SHM_RING_SLOTS) {
+        Kick();
+    }
+}
+
+/**
+ * Reset the rx eventfd after it became readable.
+ */
+void ShmChannel::AckRx() {
+    uint64_t count;
+    if (read(rx_kick_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Failed to read shared memory channel kick");
+    }
+}
+
+/**
+ * Make the rx eventfd readable again, so that the next wait for it returns
+ * right away. Used to come back to frames left on the ring.
+ */
+void ShmChannel::RearmRx() {
+    uint64_t one = 1;
+    if (write(rx_kick_fd, &one, sizeof(one)) < 0) {
+        perror("Failed to re-arm shared memory channel kick");
+    }
+}
+
+/**
+ * Block until the rx ring is not empty.
+ *
+ * @param timeout_ms[in] timeout in milliseconds, -1 to wait forever
+ * @return true if there are frames to drain
+ */
+bool ShmChannel::WaitRx(int timeout_ms) {
+    SetPolling(false);
+    // Pairs with the fence in the peer's CommitTx(), see there
+    atomic_thread_fence(memory_order_seq_cst);
+    uint32_t len;
+    // Re-check after re-enabling kicks, the peer may have skipped one
+    if (PeekRx(&len) != NULL) {
+        return true;
+    }
+    struct pollfd pfd;
+    pfd.fd = rx_kick_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout_ms) > 0) {
+        AckRx();
+    }
+    return PeekRx(&len) != NULL;
+}
+
+/**
+ * Tell the peer whether we are polling the rx ring, in which case it does
+ * not need to kick the eventfd.
+ *
+ * @param polling[in] whether the rx ring is being polled
+ */
+void ShmChannel::SetPolling(bool polling) {
+    rx_ring->no_notify.store(polling ? 1 : 0, memory_order_relaxed);
+}
@@ -0,0 +1,464 @@
+#include <hypervisor.h>
+#include <vm.h>
+#include <eth_util.h>
+#include <ip_util.h>
+#include <dirent.h>
+#include <fcntl.h> // For open()
+#include <signal.h> // For kill()
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <vector>
+using namespace std;
+
+/**
+ * Scaling harness: create many VMs from a topology description, run ping
+ * traffic between them and report how the hypervisor copes.
+ *
+ * Usage: sudo ./tap-scale <topology file>
+ *
+ * The topology file has one "key = value" per line, '#' starts a comment.
+ * See scale.topo for the keys and their defaults. Out-of-process VMs run
+ * tap-vm from the directory of tap-scale.
+ */
+
+struct Topology {
+    int vms;                 // number of VMs to create
+    int remote_vms;          // number of out-of-process VMs, pinged but not pinging
+    string mac_base;         // MAC address of the first VM, the others count up
+    string ip_base;          // IP address of the first VM, the others count up
+    string traffic;          // all-pairs, ring or hot-spot
+    int hot_spot;            // VM every other VM pings with hot-spot traffic
+    int pings;               // pings per flow
+    int concurrency;         // threads sending pings
+    int timeout_ms;          // how long a ping may take
+    string bridge;           // bridge to add the TAPs to, empty if set up already
+    int busy_poll_us;        // Hypervisor::SetBusyPoll(), 0 disables
+    bool arp_suppression;    // Hypervisor::SetArpSuppression()
+    bool tap_filter;         // Hypervisor::SetTapFilter()
+
+    Topology() : vms(2), remote_vms(0), mac_base("02:00:00:00:00:01"), ip_base("192.168.1.1"),
+                 traffic("ring"), hot_spot(0), pings(1), concurrency(8),
+                 timeout_ms(1000), bridge("br0"), busy_poll_us(0),
+                 arp_suppression(false), tap_filter(false) {}
+};
+
+/**
+ * Parse a topology file.
+ *
+ * @param path[in]  path of the topology file
+ * @param topo[out] the topology
+ * @return false if the file cannot be read or has an unknown key
+ */
+static bool ParseTopology(const string &path, Topology *topo) {
+    ifstream in(path);
+    if (!in) {
+        cerr << "Cannot open " << path << endl;
+        return false;
+    }
+    string line;
+    int line_num = 0;
+    while (getline(in, line)) {
+        line_num++;
+        line = line.substr(0, line.find('#'));
+        size_t eq = line.find('=');
+        if (eq == string::npos) {
+            continue;
+        }
+        stringstream key_ss(line.substr(0, eq)), value_ss(line.substr(eq + 1));
+        string key, value;
+        key_ss >> key;
+        value_ss >> value;
+        if (key == "vms") {
+            topo->vms = stoi(value);
+        } else if (key == "remote_vms") {
+            topo->remote_vms = stoi(value);
+        } else if (key == "mac_base") {
+            topo->mac_base = value;
+        } else if (key == "ip_base") {
+            topo->ip_base = value;
+        } else if (key == "traffic") {
+            topo->traffic = value;
+        } else if (key == "hot_spot") {
+            topo->hot_spot = stoi(value);
+        } else if (key == "pings") {
+            topo->pings = stoi(value);
+        } else if (key == "concurrency") {
+            topo->concurrency = stoi(value);
+        } else if (key == "timeout_ms") {
+            topo->timeout_ms = stoi(value);
+        } else if (key == "bridge") {
+            topo->bridge = value;
+        } else if (key == "busy_poll_us") {
+            topo->busy_poll_us = stoi(value);
+        } else if (key == "arp_suppression") {
+            topo->arp_suppression = value == "true";
+        } else if (key == "tap_filter") {
+            topo->tap_filter = value == "true";
+        } else {
+            cerr << path << ":" << line_num << ": unknown key " << key << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Get the MAC address n after a base address.
+ */
+static string NthMac(const string &base, int n) {
+    uint8_t bytes[ETH_ALEN];
+    EthUtil::MacStringToBytes(base, bytes);
+    uint64_t value = 0;
+    for (int i = 0; i < ETH_ALEN; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    value += n;
+    for (int i = ETH_ALEN - 1; i >= 0; i--) {
+        bytes[i] = value & 0xFF;
+        value >>= 8;
+    }
+    return EthUtil::MacBytesToString(bytes);
+}
+
+/**
+ * Get the IP address n after a base address.
+ */
+static string NthIp(const string &base, int n) {
+    uint8_t bytes[IPV4_ALEN];
+    IpUtil::IpStringToBytes(base, bytes);
+    uint32_t value = ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) |
+                     ((uint32_t) bytes[2] << 8) | bytes[3];
+    value += n;
+    for (int i = IPV4_ALEN - 1; i >= 0; i--) {
+        bytes[i] = value & 0xFF;
+        value >>= 8;
+    }
+    return IpUtil::IpBytesToString(bytes);
+}
+
+/**
+ * Snapshot of the resources the process uses.
+ */
+struct Footprint {
+    bool valid;
+    long rss_kb;
+    long threads;
+    long fds;
+};
+
+/**
+ * Take a snapshot of the resources the process uses. The status file and
+ * fd directory are opened once up front, so a snapshot still works after
+ * the VMs have used up the descriptor limit.
+ *
+ * @param status_fd[in] /proc/self/status, read with pread()
+ * @param fd_dir[in]    /proc/self/fd, rewound before counting
+ * @return the snapshot, not valid if it could not be read
+ */
+static Footprint GetFootprint(int status_fd, DIR *fd_dir) {
+    Footprint footprint = {false, 0, 0, 0};
+    char buf[8192];
+    ssize_t len = status_fd < 0 ? -1 : pread(status_fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0 || fd_dir == NULL) {
+        return footprint;
+    }
+    buf[len] = '\0';
+    stringstream status(buf);
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) {
+            footprint.rss_kb = stol(line.substr(6));
+        } else if (line.compare(0, 8, "Threads:") == 0) {
+            footprint.threads = stol(line.substr(8));
+        }
+    }
+    // Counts ".", ".." and the held descriptors too, which cancel out in a diff
+    rewinddir(fd_dir);
+    while (readdir(fd_dir) != NULL) {
+        footprint.fds++;
+    }
+    footprint.valid = true;
+    return footprint;
+}
+
+/**
+ * Build the list of (source, destination) flows of a traffic matrix.
+ * Only the first senders VMs send, as out-of-process VMs cannot be driven
+ * from here.
+ */
+static vector<pair<int, int>> BuildFlows(const Topology &topo, int senders, int vms) {
+    vector<pair<int, int>> flows;
+    if (topo.traffic == "all-pairs") {
+        for (int src = 0; src < senders; src++) {
+            for (int dst = 0; dst < vms; dst++) {
+                if (src != dst) {
+                    flows.push_back(make_pair(src, dst));
+                }
+            }
+        }
+    } else if (topo.traffic == "hot-spot") {
+        for (int src = 0; src < senders; src++) {
+            if (src != topo.hot_spot) {
+                flows.push_back(make_pair(src, topo.hot_spot));
+            }
+        }
+    } else {
+        for (int src = 0; src < senders && vms > 1; src++) {
+            flows.push_back(make_pair(src, (src + 1) % vms));
+        }
+    }
+    return flows;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        cerr << "Usage: " << argv[0] << " <topology file>" << endl;
+        return 1;
+    }
+    Topology topo;
+    if (!ParseTopology(argv[1], &topo)) {
+        return 1;
+    }
+    if (topo.traffic != "all-pairs" && topo.traffic != "ring" && topo.traffic != "hot-spot") {
+        cerr << "Unknown traffic " << topo.traffic << endl;
+        return 1;
+    }
+    if (topo.vms <= 0 || topo.remote_vms < 0 || topo.pings <= 0 ||
+        topo.concurrency <= 0 || topo.timeout_ms <= 0) {
+        cerr << "vms, pings, concurrency and timeout_ms must be positive" << endl;
+        return 1;
+    }
+
+    // Per-frame logging of thousands of VMs would dominate, keep cout quiet
+    cout.setstate(ios::badbit);
+
+    Hypervisor hypervisor;
+    hypervisor.SetBridge(topo.bridge);
+    hypervisor.SetTapFilter(topo.tap_filter);
+    hypervisor.SetArpSuppression(topo.arp_suppression);
+    hypervisor.SetBusyPoll(chrono::microseconds(topo.busy_poll_us));
+
+    /*
+     * Startup
+     */
+    int status_fd = open("/proc/self/status", O_RDONLY | O_CLOEXEC);
+    DIR *fd_dir = opendir("/proc/self/fd");
+    Footprint before = GetFootprint(status_fd, fd_dir);
+    vector<VirtualMachine *> vms;
+    vector<string> ips;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < topo.vms; i++) {
+        string ip = NthIp(topo.ip_base, i);
+        VirtualMachine *vm = hypervisor.createVM(NthMac(topo.mac_base, i), ip);
+        if (vm == NULL) {
+            printf("createVM failed at VM %d, continuing with %d VMs\n", i, i);
+            break;
+        }
+        vms.push_back(vm);
+        ips.push_back(ip);
+    }
+    double startup_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    Footprint after = GetFootprint(status_fd, fd_dir);
+    if (status_fd >= 0) {
+        close(status_fd);
+    }
+    if (fd_dir != NULL) {
+        closedir(fd_dir);
+    }
+    int n = vms.size();
+    if (n == 0) {
+        return 1;
+    }
+
+    printf("VMs:                 %d of %d\n", n, topo.vms);
+    printf("Startup:             %.1f ms total, %.3f ms/VM\n", startup_ms, startup_ms / n);
+    if (before.valid && after.valid) {
+        printf("Memory:              %.1f KB RSS/VM\n", (double) (after.rss_kb - before.rss_kb) / n);
+        printf("Threads:             %.2f/VM\n", (double) (after.threads - before.threads) / n);
+        printf("File descriptors:    %.2f/VM\n", (double) (after.fds - before.fds) / n);
+    } else {
+        printf("Memory:              n/a\n");
+        printf("Threads:             n/a\n");
+        printf("File descriptors:    n/a\n");
+    }
+
+    // Out-of-process VMs take the addresses after the local ones
+    string prog = argv[0];
+    size_t slash = prog.rfind('/');
+    string vm_prog = (slash == string::npos ? string(".") : prog.substr(0, slash)) + "/tap-vm";
+    vector<pid_t> pids;
+    // The VM processes inherit stdout, send their logging to /dev/null instead
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < topo.remote_vms; i++) {
+        string ip = NthIp(topo.ip_base, n + i);
+        pid_t pid = hypervisor.createRemoteVM(NthMac(topo.mac_base, n + i), ip,
+                                              vm_prog, vector<string>());
+        if (pid < 0) {
+            fprintf(stderr, "createRemoteVM failed at VM %d, continuing with %d VMs\n", i, i);
+            break;
+        }
+        pids.push_back(pid);
+        ips.push_back(ip);
+    }
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    if (topo.remote_vms > 0) {
+        double remote_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        printf("Remote VMs:          %zu of %d, %.3f ms/VM to start\n", pids.size(),
+               topo.remote_vms, pids.empty() ? 0 : remote_ms / pids.size());
+    }
+    int total = ips.size();
+    // Checked against the VMs that came up, creation may have stopped early
+    if (topo.traffic == "hot-spot" && (topo.hot_spot < 0 || topo.hot_spot >= total)) {
+        cerr << "hot_spot " << topo.hot_spot << " is not one of the " << total << " VMs" << endl;
+        for (pid_t pid : pids) {
+            kill(pid, SIGTERM);
+        }
+        _exit(1);
+    }
+
+    // Let the TAPs come up on the bridge
+    this_thread::sleep_for(chrono::seconds(1));
+
+    /*
+     * Traffic
+     */
+    vector<pair<int, int>> flows = BuildFlows(topo, n, total);
+    vector<atomic<uint64_t>> answered(n), sent(n);
+    // Active time of each VM, from the start of its first ping to the end
+    // of its last, in ns since the traffic started
+    vector<atomic<int64_t>> first_ns(n), last_ns(n);
+    for (int i = 0; i < n; i++) {
+        answered[i] = 0;
+        sent[i] = 0;
+        first_ns[i] = INT64_MAX;
+        last_ns[i] = 0;
+    }
+    vector<vector<double>> rtts(topo.concurrency);
+    atomic<size_t> next_flow(0);
+
+    auto worker = [&](int id) {
+        size_t flow;
+        while ((flow = next_flow++) < flows.size()) {
+            int src = flows[flow].first, dst = flows[flow].second;
+            int64_t begin = chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now() - start).count();
+            for (int i = 0; i < topo.pings; i++) {
+                double rtt;
+                sent[src]++;
+                if (vms[src]->Ping(ips[dst], chrono::milliseconds(topo.timeout_ms), &rtt)) {
+                    answered[src]++;
+                    rtts[id].push_back(rtt);
+                }
+            }
+            int64_t end = chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now() - start).count();
+            // Several threads may run flows of the same VM
+            int64_t seen = first_ns[src];
+            while (begin < seen && !first_ns[src].compare_exchange_weak(seen, begin)) {
+            }
+            seen = last_ns[src];
+            while (end > seen && !last_ns[src].compare_exchange_weak(seen, end)) {
+            }
+        }
+    };
+    start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int i = 0; i < topo.concurrency; i++) {
+        workers.push_back(thread(worker, i));
+    }
+    for (auto &t : workers) {
+        t.join();
+    }
+    double traffic_s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    /*
+     * Report
+     */
+    vector<double> all_rtts;
+    for (auto &r : rtts) {
+        all_rtts.insert(all_rtts.end(), r.begin(), r.end());
+    }
+    sort(all_rtts.begin(), all_rtts.end());
+    uint64_t total_sent = 0, total_answered = 0;
+    // Each VM's answered pings/s over its own active time, as every VM sends
+    // the same number of pings and a rate over the whole run would be equal
+    double sum = 0, sum_sq = 0, min_rate = 0, max_rate = 0;
+    int sources = 0;
+    for (int i = 0; i < n; i++) {
+        total_sent += sent[i];
+        total_answered += answered[i];
+        if (sent[i] > 0 && last_ns[i] > first_ns[i]) {
+            double rate = answered[i] / ((last_ns[i] - first_ns[i]) / 1e9);
+            min_rate = sources == 0 ? rate : min(min_rate, rate);
+            max_rate = sources == 0 ? rate : max(max_rate, rate);
+            sum += rate;
+            sum_sq += rate * rate;
+            sources++;
+        }
+    }
+
+    printf("Traffic:             %s, %zu flows, %d pings/flow, %d threads\n",
+           topo.traffic.c_str(), flows.size(), topo.pings, topo.concurrency);
+    printf("Pings:               %llu answered of %llu in %.2f s\n",
+           (unsigned long long) total_answered, (unsigned long long) total_sent, traffic_s);
+    printf("Throughput:          %.1f pings/s\n", total_answered / traffic_s);
+    if (!all_rtts.empty()) {
+        double mean = 0;
+        for (double rtt : all_rtts) {
+            mean += rtt;
+        }
+        mean /= all_rtts.size();
+        printf("RTT:                 mean %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+               mean, all_rtts[all_rtts.size() / 2],
+               all_rtts[min(all_rtts.size() - 1, all_rtts.size() * 99 / 100)],
+               all_rtts.back());
+    }
+    // Jain's fairness index of the per-VM answered ping rates, 1 is perfectly fair
+    if (sources > 0 && sum_sq > 0) {
+        printf("Fairness:            %.3f (Jain's index over %d sending VMs, %.1f to %.1f pings/s)\n",
+               sum * sum / (sources * sum_sq), sources, min_rate, max_rate);
+    }
+
+    uint64_t ingress_dropped = 0, egress_dropped = 0, egress_errors = 0;
+    for (VirtualMachine *vm : vms) {
+        IngressStats ingress = vm->GetIngressStats();
+        EgressStats egress = vm->GetEgressStats();
+        ingress_dropped += ingress.dropped + ingress.evicted;
+        egress_dropped += egress.dropped;
+        egress_errors += egress.errors;
+    }
+    PollStats poll = hypervisor.GetPollStats();
+    ArpSuppressionStats arp = hypervisor.GetArpSuppressionStats();
+    printf("Drops:               %llu ingress, %llu egress, %llu egress errors\n",
+           (unsigned long long) ingress_dropped, (unsigned long long) egress_dropped,
+           (unsigned long long) egress_errors);
+    printf("Hypervisor loop:     %.1f ms spinning, %.1f ms sleeping\n",
+           poll.spin_ns / 1e6, poll.sleep_ns / 1e6);
+    printf("ARP suppression:     %llu replied, %llu dropped\n",
+           (unsigned long long) arp.replied, (unsigned long long) arp.dropped);
+
+    for (pid_t pid : pids) {
+        kill(pid, SIGTERM);
+    }
+    // The VM threads never exit, skip their destructors
+    fflush(stdout);
+    _exit(0);
+}
@@ -0,0 +1,78 @@
+#include <vm.h>
+#include <shm_channel.h>
+#include <getopt.h>
+#include <iostream>
+using namespace std;
+
+static void Usage(const char *prog) {
+    cerr << "Usage: " << prog << " [-p busy_poll_us] [-f max_frames] [-b max_bytes]"
+         << " [-d tail|priority] [-n]"
+         << " <mac> <ip> <mem_fd> <tx_kick_fd> <rx_kick_fd> [ip to ping]..." << endl;
+}
+
+/**
+ * An out-of-process VM started by Hypervisor::createRemoteVM().
+ *
+ * Usage: tap-vm [options] <mac> <ip> <mem_fd> <tx_kick_fd> <rx_kick_fd> [ip to ping]...
+ *
+ *   -p budget  busy-poll budget in microseconds, 0 disables busy polling
+ *   -f frames  frames the ingress queue holds, see IngressPolicy
+ *   -b bytes   bytes the ingress queue holds
+ *   -d policy  what to drop when the ingress queue is full, tail or priority
+ *   -n         no back-pressure, drop frames instead of leaving them on the ring
+ */
+int main(int argc, char *argv[]) {
+    long busy_poll_us = 0;
+    IngressPolicy policy;
+    int opt;
+    // '+' stops at the first positional argument
+    while ((opt = getopt(argc, argv, "+p:f:b:d:n")) != -1) {
+        switch (opt) {
+            case 'p':
+                busy_poll_us = stol(optarg);
+                break;
+            case 'f':
+                policy.max_frames = stoul(optarg);
+                break;
+            case 'b':
+                policy.max_bytes = stoul(optarg);
+                break;
+            case 'd':
+                if (string(optarg) == "priority") {
+                    policy.drop_policy = INGRESS_DROP_PRIORITY;
+                } else if (string(optarg) == "tail") {
+                    policy.drop_policy = INGRESS_DROP_TAIL;
+                } else {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'n':
+                policy.backpressure = false;
+                break;
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind < 5) {
+        Usage(argv[0]);
+        return 1;
+    }
+    char **args = argv + optind;
+    ShmChannel *channel = ShmChannel::Attach(stoi(args[2]), stoi(args[3]), stoi(args[4]));
+    if (channel == NULL) {
+        return 1;
+    }
+    VirtualMachine *vm = new VirtualMachine(args[0], args[1], channel);
+    vm->SetBusyPoll(chrono::microseconds(busy_poll_us));
+    vm->SetIngressPolicy(policy);
+    // Wait for the peers to start
+    this_thread::sleep_for (std::chrono::seconds(1));
+    for (int i = 5; i < argc - optind; i++) {
+        vm->Ping(args[i]);
+    }
+
+    this_thread::sleep_for (std::chrono::seconds(300));
+    return 0;
+}
@@ -2,7 +2,10 @@
 #include <arp_util.h>
 #include <ip_util.h>
 #include <icmp_util.h>
+#include <cpu_util.h>
 #include <arpa/inet.h>
+#include <iterator>
+#include <cstring>
 #include <iostream>
 
 /**
@@ -11,9 +14,12 @@
  */
 void VirtualMachine::HandleIngressArp() {
     struct arp_hdr arp_hdr;
-    RecvFromNetwork((uint8_t *)&arp_hdr, sizeof(arp_hdr));
     struct arp_ipv4 arp_ipv4;
-    RecvFromNetwork((uint8_t *)&arp_ipv4, sizeof(arp_ipv4));
+    if (!RecvFromNetwork((uint8_t *)&arp_hdr, sizeof(arp_hdr)) ||
+        !RecvFromNetwork((uint8_t *)&arp_ipv4, sizeof(arp_ipv4))) {
+        cout << "[" << ip << "] Received truncated ARP packet" << endl;
+        return;
+    }
     // From network byte order (big endian) to host byte order (little endian)
     arp_hdr.arp_op = ntohs(arp_hdr.arp_op);
     string src_mac = EthUtil::MacBytesToString(arp_ipv4.arp_sha);
@@ -32,7 +38,7 @@ void VirtualMachine::HandleIngressArp() {
     } else if (arp_hdr.arp_op == ARP_OP_REPLY) {
         unique_lock<mutex> arp_lock(arp_table_mutex);
         arp_table[src_ip] = src_mac;
-        arp_cv.notify_one();
+        arp_cv.notify_all();
     } else {
         cout << "[" << ip << "] Received unsupported ARP type " << arp_hdr.arp_op << endl;
     }
@@ -46,16 +52,22 @@ void VirtualMachine::HandleIngressArp() {
  */
 void VirtualMachine::HandleIngressIcmp(const string &src_mac) {
     struct ipv4_hdr ip_hdr;
-    RecvFromNetwork((uint8_t *)&ip_hdr, sizeof(ip_hdr));
+    if (!RecvFromNetwork((uint8_t *)&ip_hdr, sizeof(ip_hdr))) {
+        cout << "[" << ip << "] Received truncated IP packet" << endl;
+        return;
+    }
     string dst_ip = IpUtil::IpBytesToString(ip_hdr.dst_addr);
     if (dst_ip != ip) {
         return;
     }
     string src_ip = IpUtil::IpBytesToString(ip_hdr.src_addr);
     struct icmp_hdr icmp_hdr;
-    RecvFromNetwork((uint8_t *)&icmp_hdr, sizeof(icmp_hdr));
     struct icmp_echo icmp_echo;
-    RecvFromNetwork((uint8_t *)&icmp_echo, sizeof(icmp_echo));
+    if (!RecvFromNetwork((uint8_t *)&icmp_hdr, sizeof(icmp_hdr)) ||
+        !RecvFromNetwork((uint8_t *)&icmp_echo, sizeof(icmp_echo))) {
+        cout << "[" << ip << "] Received truncated ICMP packet" << endl;
+        return;
+    }
     uint16_t id = icmp_echo.id, seq_num = icmp_echo.seq_num;
     if (icmp_hdr.icmp_type == ICMP_ECHO_REQUEST) {
         cout << "[" << ip << "] Received ICMP request id = " << id
@@ -67,8 +79,14 @@ void VirtualMachine::HandleIngressIcmp(const string &src_mac) {
         cout << "[" << ip << "] Received ICMP reply id = " << id
              << ", seq_num = " << seq_num<< endl;
         unique_lock<mutex> icmp_lock(icmp_reply_mutex);
-        icmp_replies.insert({id, seq_num});
-        icmp_cv.notify_one();
+        auto it = icmp_waiters.find({id, seq_num});
+        if (it == icmp_waiters.end()) {
+            // The ping timed out, or the reply is for someone else
+            cout << "[" << ip << "] Ignore unexpected ICMP reply" << endl;
+            return;
+        }
+        it->second = true;
+        icmp_cv.notify_all();
     } else {
         cout << "[" << ip << "] Received unsupported ICMP type "
              << icmp_hdr.icmp_type << endl;
@@ -77,16 +95,43 @@ void VirtualMachine::HandleIngressIcmp(const string &src_mac) {
 
 /**
  * Initialize the virtual machine. It starts a thread that handles ingress packets.
+ * If the VM has a CPU, the thread pins itself there, prefers memory from
+ * that CPU's NUMA node and faults in the ingress frame buffers there.
+ *
+ * The VirtualMachine object itself is allocated by the thread calling the
+ * constructor, so it lives on that thread's node.
  */
 void VirtualMachine::Init() {
     icmp_id = 1;
     icmp_seq = 1;
+    ingress_bytes = 0;
+    ingress_offset = 0;
+    ingress_pending = 0;
+    ingress_full = false;
+    ingress_backpressure = ingress_policy.backpressure;
+    ingress_enqueued = ingress_dropped = ingress_evicted = ingress_throttled = 0;
+    ingress_resumed = 0;
+    busy_poll_us = 0;
+    egress_polled = false;
+    egress_pending = 0;
+    egress_enqueued = egress_sent = egress_dropped = egress_errors = 0;
+    egress_doorbells = egress_flushes = egress_intercepted = 0;
     // Right now we only support ingress ARP and ICMP packets
     auto loop = [&]() {
+        if (cpu >= 0 && CpuUtil::PinCurrentThread(cpu) == 0) {
+            int node = CpuUtil::GetNumaNode(cpu);
+            if (node >= 0 && CpuUtil::SetPreferredNode(node) == 0) {
+                FillIngressPool();
+            }
+        }
         cout << "VM [" << ip << ", " << mac << "] starts running." << endl;
         while (true) {
+            NextIngressFrame();
             struct eth_hdr eth_hdr;
-            RecvFromNetwork((uint8_t *)&eth_hdr, sizeof(eth_hdr));
+            if (!RecvFromNetwork((uint8_t *)&eth_hdr, sizeof(eth_hdr))) {
+                cout << "[" << ip << "] Received truncated ethernet frame" << endl;
+                continue;
+            }
             string src_mac = EthUtil::MacBytesToString(eth_hdr.h_source);
             cout << "[" << ip << "] Received ethernet frame from " << src_mac << endl;
             eth_hdr.h_proto = ntohs(eth_hdr.h_proto);
@@ -101,6 +146,76 @@ void VirtualMachine::Init() {
         }
     };
     ingress_proc_thread = thread(loop);
+
+    if (channel != NULL) {
+        // Out of process, frames from the hypervisor arrive on the shared ring
+        auto channel_loop = [&]() {
+            while (true) {
+                if (ingress_full) {
+                    // Leave frames on the ring until the ingress queue has room
+                    unique_lock<mutex> lock(ingress_queue_mutex);
+                    ingress_space_cv.wait(lock, [&]{ return !ingress_full; });
+                }
+                if (DrainChannel() > 0) {
+                    continue;
+                }
+                long budget = busy_poll_us;
+                if (budget > 0) {
+                    // Poll the ring with kicks from the hypervisor suppressed
+                    channel->SetPolling(true);
+                    auto start = chrono::steady_clock::now();
+                    auto deadline = start + chrono::microseconds(budget);
+                    bool hit;
+                    do {
+                        hit = DrainChannel() > 0;
+                    } while (!hit && chrono::steady_clock::now() < deadline);
+                    auto spin = chrono::steady_clock::now() - start;
+                    channel_poll_counters.AddSpin(chrono::duration_cast<chrono::nanoseconds>(spin).count(), hit);
+                    if (hit) {
+                        continue;
+                    }
+                }
+                auto start = chrono::steady_clock::now();
+                channel->WaitRx(-1);
+                auto sleep = chrono::steady_clock::now() - start;
+                channel_poll_counters.AddSleep(chrono::duration_cast<chrono::nanoseconds>(sleep).count());
+            }
+        };
+        channel_thread = thread(channel_loop);
+    }
+}
+
+/**
+ * Allocate the spare ingress frame buffers from the calling thread. SendToVm()
+ * copies frames into them on the hypervisor thread, which would otherwise
+ * allocate, and so place, them on the hypervisor's NUMA node.
+ */
+void VirtualMachine::FillIngressPool() {
+    deque<vector<uint8_t>> pool(INGRESS_POOL_FRAMES);
+    for (auto &buf : pool) {
+        // Writing the buffer faults its pages in under our memory policy
+        buf.resize(SHM_SLOT_SIZE);
+        buf.clear();
+    }
+    lock_guard<mutex> lock(ingress_queue_mutex);
+    ingress_pool.swap(pool);
+}
+
+/**
+ * Move all frames on the shared ring from the hypervisor to the ingress queue.
+ *
+ * @return number of frames moved
+ */
+int VirtualMachine::DrainChannel() {
+    int frames = 0;
+    uint32_t len;
+    const uint8_t *frame;
+    while (!ingress_full && (frame = channel->PeekRx(&len)) != NULL) {
+        SendToVm(frame, len);
+        channel->ReleaseRx();
+        frames++;
+    }
+    return frames;
 }
 
 /**
@@ -167,70 +282,378 @@ void VirtualMachine::SendIcmp(const string &dst_ip, const string &dst_mac,
  * @param dst_ip[in] the IP address to ping
  */
 void VirtualMachine::Ping(const string &dst_ip) {
-    unique_lock<mutex> arp_lock(arp_table_mutex);
-    if (arp_table.find(dst_ip) == arp_table.end()) {
-        cout << "[" << ip << "] Sending ARP request to "
-             << dst_ip << "..." << endl;
-        SendArp(dst_ip, kEthBroadcastAddr, ARP_OP_REQUEST);
-        cout << "[" << ip << "] Waiting for ARP reply from "
-             << dst_ip << "..." << endl;
-        arp_cv.wait(arp_lock, [&]{ return arp_table.find(dst_ip) != arp_table.end(); });
-    }
+    Ping(dst_ip, chrono::hours(24 * 365), NULL);
+}
 
-    string dst_mac = arp_table[dst_ip];
-    uint16_t id = icmp_id++, seq_num = icmp_seq++;
-    pair<uint16_t, uint16_t> key = make_pair(id, seq_num);
+/**
+ * Ping an IP address, giving up after a timeout. Several threads may ping
+ * from the same VM at once.
+ *
+ * @param dst_ip[in]  the IP address to ping
+ * @param timeout[in] how long to wait for the ARP and ICMP replies
+ * @param rtt_ms[out] round trip time in milliseconds, may be NULL
+ * @return true if the ping was answered in time
+ */
+bool VirtualMachine::Ping(const string &dst_ip, chrono::milliseconds timeout, double *rtt_ms) {
+    auto deadline = chrono::steady_clock::now() + timeout;
+    string dst_mac;
+    pair<uint16_t, uint16_t> key;
+    {
+        unique_lock<mutex> arp_lock(arp_table_mutex);
+        if (arp_table.find(dst_ip) == arp_table.end()) {
+            cout << "[" << ip << "] Sending ARP request to "
+                 << dst_ip << "..." << endl;
+            SendArp(dst_ip, kEthBroadcastAddr, ARP_OP_REQUEST);
+            cout << "[" << ip << "] Waiting for ARP reply from "
+                 << dst_ip << "..." << endl;
+            if (!arp_cv.wait_until(arp_lock, deadline,
+                                   [&]{ return arp_table.find(dst_ip) != arp_table.end(); })) {
+                cout << "[" << ip << "] ARP request to " << dst_ip << " timed out" << endl;
+                return false;
+            }
+        }
+        dst_mac = arp_table[dst_ip];
+        key = make_pair(icmp_id++, icmp_seq++);
+    }
+    // Don't hold the ARP table while waiting, the ingress thread needs it
+    uint16_t id = key.first, seq_num = key.second;
 
     cout << "[" << ip << "] Ping " << dst_ip << " ..." << endl;
     auto start = chrono::steady_clock::now();
 
-    SendIcmp(dst_ip, dst_mac, ICMP_ECHO_REQUEST, id, seq_num);
     unique_lock<mutex> icmp_lock(icmp_reply_mutex);
-    icmp_cv.wait(icmp_lock, [&]{ return icmp_replies.find(key) != icmp_replies.end();});
+    // Register before sending so the reply cannot arrive unexpected
+    icmp_waiters[key] = false;
+    icmp_lock.unlock();
+    SendIcmp(dst_ip, dst_mac, ICMP_ECHO_REQUEST, id, seq_num);
+    icmp_lock.lock();
+    bool answered = icmp_cv.wait_until(icmp_lock, deadline, [&]{ return icmp_waiters[key]; });
+    // Replies arriving from now on match no waiter and are dropped
+    icmp_waiters.erase(key);
+    if (!answered) {
+        cout << "[" << ip << "] Ping " << dst_ip << " icmp_seq=" << seq_num
+             << " timed out" << endl;
+        return false;
+    }
 
     auto end = chrono::steady_clock::now();
     auto diff = end - start;
     cout << "[" << ip << "] Ping response from " << ip << ": icmp_seq=" << seq_num;
     cout << " time=" << chrono::duration <double, milli> (diff).count() << " ms" << endl;
-
-    icmp_replies.erase(key);
+    if (rtt_ms != NULL) {
+        *rtt_ms = chrono::duration <double, milli> (diff).count();
+    }
+    return true;
 }
 
 /**
- * Send bytes from the VM to network.
+ * Send a frame from the VM to network. The frame is queued and written to
+ * the TAP by the hypervisor, which flushes the whole queue on one doorbell.
+ * If the queue is full, wait up to a second for the hypervisor to drain it.
  *
  * @param[in] buf the byte buffer to send
  * @param[in] len length of the buffer
  */
 void VirtualMachine::SendToNetwork(const uint8_t *buf, size_t len) {
-    write(tap_fd, buf, len);
+    if (channel != NULL) {
+        // The ring has a single producer, but both Ping() and the ingress
+        // thread send. The egress queue is unused out of process, so reuse its lock.
+        lock_guard<mutex> lock(egress_queue_mutex);
+        if (!channel->Send(buf, len)) {
+            cout << "[" << ip << "] Dropped egress frame, shared ring is full" << endl;
+        }
+        return;
+    }
+
+    unique_lock<mutex> lock(egress_queue_mutex);
+    if (!egress_cv.wait_for(lock, chrono::seconds(1),
+                            [&]{ return egress_queue.size() < EGRESS_QUEUE_LEN; })) {
+        egress_dropped++;
+        cout << "[" << ip << "] Dropped egress frame, egress queue is full" << endl;
+        return;
+    }
+    bool was_empty = egress_queue.empty();
+    egress_queue.emplace_back(buf, buf + len);
+    egress_pending++;
+    egress_enqueued++;
+    // Only the first frame of a batch rings the doorbell
+    if (was_empty && !egress_polled) {
+        RingDoorbell();
+        egress_doorbells++;
+    }
+}
+
+/**
+ * Kick the hypervisor, either to flush the egress queue or to resume reading
+ * the TAP after the ingress queue made room.
+ */
+void VirtualMachine::RingDoorbell() {
+    uint64_t one = 1;
+    if (write(doorbell_fd, &one, sizeof(one)) < 0) {
+        perror("Failed to ring doorbell");
+    }
+}
+
+/**
+ * Reset the doorbell after it became readable.
+ */
+void VirtualMachine::AckDoorbell() {
+    uint64_t count;
+    if (read(doorbell_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Failed to read egress doorbell");
+    }
+}
+
+/**
+ * Write all queued egress frames to the TAP. Called from the hypervisor.
+ * If the TAP would block, the remaining frames stay queued in order.
+ *
+ * @param[out] blocked whether the TAP returned EAGAIN
+ * @param[in] intercept returns true for frames the hypervisor handles itself,
+ *                      those are not written to the TAP
+ * @return number of frames written
+ */
+int VirtualMachine::FlushEgress(bool *blocked,
+                                const function<bool(const uint8_t *, size_t)> &intercept) {
+    deque<vector<uint8_t>> batch;
+    {
+        lock_guard<mutex> lock(egress_queue_mutex);
+        batch.swap(egress_queue);
+    }
+    egress_flushes++;
+    *blocked = false;
+    int frames = 0;
+    size_t done = 0;
+    for (auto &frame : batch) {
+        if (intercept(frame.data(), frame.size())) {
+            egress_intercepted++;
+            done++;
+            continue;
+        }
+        ssize_t ret = write(tap_fd, frame.data(), frame.size());
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            *blocked = true;
+            break;
+        }
+        if (ret < 0) {
+            perror("write()");
+            egress_errors++;
+        } else if ((size_t) ret != frame.size()) {
+            // The TAP takes a frame per write(), a short write truncated it
+            egress_errors++;
+        } else {
+            egress_sent++;
+            frames++;
+        }
+        done++;
+    }
+
+    lock_guard<mutex> lock(egress_queue_mutex);
+    // Put back what the TAP did not take, ahead of frames queued meanwhile
+    egress_queue.insert(egress_queue.begin(),
+                        make_move_iterator(batch.begin() + done),
+                        make_move_iterator(batch.end()));
+    egress_pending -= done;
+    egress_cv.notify_all();
+    return frames;
+}
+
+/**
+ * Take a snapshot of the egress counters.
+ *
+ * @return the current values of the counters
+ */
+EgressStats VirtualMachine::GetEgressStats() const {
+    EgressStats stats;
+    stats.enqueued = egress_enqueued;
+    stats.sent = egress_sent;
+    stats.dropped = egress_dropped;
+    stats.errors = egress_errors;
+    stats.intercepted = egress_intercepted;
+    stats.doorbells = egress_doorbells;
+    stats.flushes = egress_flushes;
+    return stats;
+}
+
+/**
+ * Wait until the ingress queue is not empty. With busy polling enabled, spin
+ * for up to the budget before blocking on the condition variable.
+ */
+void VirtualMachine::WaitForIngress() {
+    if (ingress_pending > 0) {
+        return;
+    }
+    long budget = busy_poll_us;
+    if (budget > 0) {
+        auto start = chrono::steady_clock::now();
+        auto deadline = start + chrono::microseconds(budget);
+        bool hit;
+        do {
+            hit = ingress_pending > 0;
+        } while (!hit && chrono::steady_clock::now() < deadline);
+        auto spin = chrono::steady_clock::now() - start;
+        poll_counters.AddSpin(chrono::duration_cast<chrono::nanoseconds>(spin).count(), hit);
+        if (hit) {
+            return;
+        }
+    }
+    auto start = chrono::steady_clock::now();
+    unique_lock<mutex> lock(ingress_queue_mutex);
+    ingress_cv.wait(lock, [&]{ return !ingress_queue.empty(); });
+    auto sleep = chrono::steady_clock::now() - start;
+    poll_counters.AddSleep(chrono::duration_cast<chrono::nanoseconds>(sleep).count());
+}
+
+/**
+ * Wait for the next ingress frame and make it the frame RecvFromNetwork()
+ * reads from. Whatever is left of the previous frame is discarded.
+ * This is a blocking call.
+ */
+void VirtualMachine::NextIngressFrame() {
+    WaitForIngress();
+    unique_lock<mutex> lock(ingress_queue_mutex);
+    ingress_cv.wait(lock, [&]{ return !ingress_queue.empty(); });
+    ingress_frame.swap(ingress_queue.front());
+    // Hand the previous frame back if it came from the pool
+    vector<uint8_t> &done = ingress_queue.front();
+    if (done.capacity() >= SHM_SLOT_SIZE && ingress_pool.size() < INGRESS_POOL_FRAMES) {
+        ingress_pool.push_back(move(done));
+    }
+    ingress_queue.pop_front();
+    ingress_bytes -= ingress_frame.size();
+    ingress_offset = 0;
+    ingress_pending--;
+
+    bool was_full = ingress_full;
+    UpdateIngressFull();
+    if (was_full && !ingress_full) {
+        ingress_space_cv.notify_all();
+        if (ingress_backpressure && doorbell_fd >= 0) {
+            // The hypervisor stopped reading our TAP, tell it to resume
+            RingDoorbell();
+            ingress_resumed++;
+        }
+    }
 }
 
 /**
- * Receive bytes from the network. This is a blocking call.
+ * Receive bytes of the current ingress frame.
  *
  * @param[out] buf the buffer to receive bytes
  * @param[in] len length of bytes to receive
+ * @return false if the frame is shorter than that
  */
-void VirtualMachine::RecvFromNetwork(uint8_t *buf, size_t len) {
-    for (size_t i = 0; i < len; i++) {
-        unique_lock<mutex> lock(ingress_queue_mutex);
-        ingress_cv.wait(lock, [&]{ return !ingress_queue.empty(); });
-        buf[i] = ingress_queue.front();
-        ingress_queue.pop();
+bool VirtualMachine::RecvFromNetwork(uint8_t *buf, size_t len) {
+    if (ingress_offset + len > ingress_frame.size()) {
+        return false;
     }
+    memcpy(buf, ingress_frame.data() + ingress_offset, len);
+    ingress_offset += len;
+    return true;
 }
 
 /**
- * Send bytes from network to the VM.
+ * Check whether a frame should survive when the ingress queue is full.
+ * ARP is kept over everything else as losing it stalls all traffic to a peer.
+ *
+ * @param[in] frame the frame
+ * @param[in] len   length of the frame
+ * @return true if the frame has priority
+ */
+static bool IsPriorityFrame(const uint8_t *frame, size_t len) {
+    return len >= ETH_HDR_LEN &&
+           ntohs(((const struct eth_hdr *) frame)->h_proto) == ETH_P_ARP;
+}
+
+/**
+ * Recompute whether the ingress queue is at its bounds.
+ * Must be called with ingress_queue_mutex held.
+ */
+void VirtualMachine::UpdateIngressFull() {
+    ingress_full = ingress_queue.size() >= ingress_policy.max_frames ||
+                   ingress_bytes >= ingress_policy.max_bytes;
+}
+
+/**
+ * Send a frame from network to the VM. If the ingress queue is full, the
+ * frame or, with INGRESS_DROP_PRIORITY, lower priority frames are dropped.
  *
  * @param[in] buf the byte buffer
  * @param[in] len length of the buffer
+ * @return true if the frame was queued
  */
-void VirtualMachine::SendToVm(const uint8_t *buf, size_t len) {
+bool VirtualMachine::SendToVm(const uint8_t *buf, size_t len) {
     unique_lock<mutex> lock(ingress_queue_mutex);
-    for (size_t i = 0; i < len; i++) {
-        ingress_queue.push(buf[i]);
+    if (ingress_full && ingress_policy.drop_policy == INGRESS_DROP_PRIORITY &&
+        IsPriorityFrame(buf, len)) {
+        // Evict the newest frames without priority until the queue has room
+        auto it = ingress_queue.end();
+        while (ingress_full && it != ingress_queue.begin()) {
+            --it;
+            if (!IsPriorityFrame(it->data(), it->size())) {
+                ingress_bytes -= it->size();
+                it = ingress_queue.erase(it);
+                ingress_pending--;
+                ingress_evicted++;
+                UpdateIngressFull();
+            }
+        }
+    }
+    if (ingress_full) {
+        ingress_dropped++;
+        return false;
+    }
+
+    if (!ingress_pool.empty() && len <= SHM_SLOT_SIZE) {
+        // Reuse a buffer on the VM's node, assign() does not reallocate it
+        ingress_queue.push_back(move(ingress_pool.back()));
+        ingress_pool.pop_back();
+        ingress_queue.back().assign(buf, buf + len);
+    } else {
+        ingress_queue.emplace_back(buf, buf + len);
+    }
+    ingress_bytes += len;
+    ingress_pending++;
+    ingress_enqueued++;
+    UpdateIngressFull();
+    if (ingress_full) {
+        ingress_throttled++;
     }
     ingress_cv.notify_one();
+    return true;
+}
+
+/**
+ * Set the bounds and drop policy of the ingress queue.
+ *
+ * @param[in] policy the ingress policy
+ */
+void VirtualMachine::SetIngressPolicy(const IngressPolicy &policy) {
+    lock_guard<mutex> lock(ingress_queue_mutex);
+    bool was_throttled = IsIngressThrottled();
+    ingress_policy = policy;
+    ingress_backpressure = policy.backpressure;
+    UpdateIngressFull();
+    if (!ingress_full) {
+        ingress_space_cv.notify_all();
+    }
+    if (was_throttled && !IsIngressThrottled() && doorbell_fd >= 0) {
+        RingDoorbell();
+        ingress_resumed++;
+    }
+}
+
+/**
+ * Take a snapshot of the ingress counters.
+ *
+ * @return the current values of the counters
+ */
+IngressStats VirtualMachine::GetIngressStats() const {
+    IngressStats stats;
+    stats.enqueued = ingress_enqueued;
+    stats.dropped = ingress_dropped;
+    stats.evicted = ingress_evicted;
+    stats.throttled = ingress_throttled;
+    stats.resumed = ingress_resumed;
+    return stats;
 }